@@ -89,6 +89,22 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* Hash function for 64 bit integer keys: the key is mixed with the seed,
+ * then scrambled with the finalizer of MurmurHash3, which is a bijection
+ * where every input bit affects every output bit. */
+uint64_t dictGenIntHashFunction(uint64_t key) {
+    uint64_t seed;
+
+    memcpy(&seed,dict_hash_function_seed,sizeof(seed));
+    key ^= seed;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -495,6 +511,15 @@ void *dictFetchValue(dict *d, const void *key) {
     return he ? dictGetVal(he) : NULL;
 }
 
+/* Prefetch the buckets where a key with hash 'hash' is looked up, so that
+ * a later dictFind() of the key doesn't wait for them. This is useful to
+ * overlap the cache misses of a batch of lookups. */
+void dictPrefetch(dict *d, uint64_t hash)
+{
+    if (d->ht[0].size) __builtin_prefetch(&d->ht[0].table[hash & d->ht[0].sizemask]);
+    if (dictIsRehashing(d)) __builtin_prefetch(&d->ht[1].table[hash & d->ht[1].sizemask]);
+}
+
 /* A fingerprint is a 64 bit number that represents the state of the dictionary
  * at a given time, it's just a few dict properties xored together.
  * When an unsafe iterator is initialized, we get the dict fingerprint, and check
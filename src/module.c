@@ -1,3 +1,4 @@
+#include <strings.h>
 #include "redismodule.h"
 #include "rmutil/util.h"
 #include "rmutil/strings.h"
@@ -8,7 +9,93 @@
 
 RedisModuleType *ZSetTsType;
 
-int RedisModule_OnLoad(RedisModuleCtx *ctx) {
+zsetTsConfig ztsConfig = {
+  .zset_max_packed_entries = 128,
+  .zset_max_packed_value = 64,
+  .zset_engine = ZSET_ENGINE_SKIPLIST,
+  .zset_node_pool = 0,
+  .zset_int_members = 0,
+  .zset_intern_members = 0,
+  .zset_lazy_free = 0,
+  .zset_random_seed = 0
+};
+
+// Parse a yes/no option value, returning -1 if it is neither
+static int parseYesNo(RedisModuleString *arg) {
+  const char *s = RedisModule_StringPtrLen(arg, NULL);
+
+  if (!strcasecmp(s, "yes")) return 1;
+  if (!strcasecmp(s, "no")) return 0;
+  return -1;
+}
+
+// Parse the "name value" pairs given as module load arguments
+static int parseModuleArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  long long value;
+  int j;
+
+  if (argc % 2) {
+    RedisModule_Log(ctx, "warning", "module arguments must be name/value pairs");
+    return REDISMODULE_ERR;
+  }
+
+  for (j = 0; j < argc; j += 2) {
+    const char *name = RedisModule_StringPtrLen(argv[j], NULL);
+
+    if (!strcasecmp(name, "zset-engine")) {
+      const char *engine = RedisModule_StringPtrLen(argv[j+1], NULL);
+
+      if (!strcasecmp(engine, "skiplist")) {
+        ztsConfig.zset_engine = ZSET_ENGINE_SKIPLIST;
+      } else if (!strcasecmp(engine, "btree")) {
+        ztsConfig.zset_engine = ZSET_ENGINE_BTREE;
+      } else {
+        RedisModule_Log(ctx, "warning", "invalid value for %s", name);
+        return REDISMODULE_ERR;
+      }
+      continue;
+    } else if (!strcasecmp(name, "zset-node-pool") ||
+               !strcasecmp(name, "zset-int-members") ||
+               !strcasecmp(name, "zset-intern-members") ||
+               !strcasecmp(name, "zset-lazy-free")) {
+      int yes = parseYesNo(argv[j+1]);
+
+      if (yes == -1) {
+        RedisModule_Log(ctx, "warning", "invalid value for %s", name);
+        return REDISMODULE_ERR;
+      }
+      if (!strcasecmp(name, "zset-node-pool"))
+        ztsConfig.zset_node_pool = yes;
+      else if (!strcasecmp(name, "zset-int-members"))
+        ztsConfig.zset_int_members = yes;
+      else if (!strcasecmp(name, "zset-intern-members"))
+        ztsConfig.zset_intern_members = yes;
+      else
+        ztsConfig.zset_lazy_free = yes;
+      continue;
+    }
+
+    if (RedisModule_StringToLongLong(argv[j+1], &value) != REDISMODULE_OK ||
+        value < 0) {
+      RedisModule_Log(ctx, "warning", "invalid value for %s", name);
+      return REDISMODULE_ERR;
+    }
+
+    if (!strcasecmp(name, "zset-max-packed-entries")) {
+      ztsConfig.zset_max_packed_entries = value;
+    } else if (!strcasecmp(name, "zset-max-packed-value")) {
+      ztsConfig.zset_max_packed_value = value;
+    } else if (!strcasecmp(name, "zset-random-seed")) {
+      ztsConfig.zset_random_seed = value;
+    } else {
+      RedisModule_Log(ctx, "warning", "unknown module argument %s", name);
+      return REDISMODULE_ERR;
+    }
+  }
+  return REDISMODULE_OK;
+}
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 
   // Register the module itself
   if (RedisModule_Init(ctx, "zset-with-time", 1, REDISMODULE_APIVER_1) ==
@@ -16,13 +103,21 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
     return REDISMODULE_ERR;
   }
 
+  if (parseModuleArgs(ctx, argv, argc) == REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  zslSeedRandom(ztsConfig.zset_random_seed);
+
   // Register the data type
   RedisModuleTypeMethods tm = {
     .version = REDISMODULE_TYPE_METHOD_VERSION,
     .rdb_load = zsetTsRDBLoad,
     .rdb_save = zsetTsRDBSave,
     .aof_rewrite = zsetTsAOFRewrite,
-    .free = freeZsetObject
+    .free = freeZsetObject,
+    .mem_usage = zsetMemUsage,
+    .free_effort = zsetFreeEffort,
+    .defrag = zsetDefrag
   };
 
   ZSetTsType = RedisModule_CreateDataType(ctx, "ZSetWithT", ZSETTS_ENCODING_VERSION, &tm);
@@ -42,8 +137,16 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
   RMUtil_RegisterReadCmd(ctx, "zts.zrevrank", zrevrankCommand);
   RMUtil_RegisterReadCmd(ctx, "zts.zrange", zrangeCommand);
   RMUtil_RegisterReadCmd(ctx, "zts.zrevrange", zrevrangeCommand);
+  RMUtil_RegisterReadCmd(ctx, "zts.zrangeafter", zrangeafterCommand);
   RMUtil_RegisterReadCmd(ctx, "zts.zrangebyscore", zrangebyscoreCommand);
   RMUtil_RegisterReadCmd(ctx, "zts.zrevrangebyscore", zrevrangebyscoreCommand);
+  RMUtil_RegisterReadCmd(ctx, "zts.stats", zstatsCommand);
+  if (RedisModule_CreateCommand(ctx, "zts.compact", zcompactCommand,
+                                "write deny-oom", 1, 1, 1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+  if (RedisModule_CreateCommand(ctx, "zts.internstats", zinternstatsCommand,
+                                "readonly", 0, 0, 0) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
 
   return REDISMODULE_OK;
 }
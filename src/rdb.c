@@ -1,18 +1,36 @@
 #include "rdb.h"
 #include "zsetts.h"
+#include "zpack.h"
 
 void zsetTsRDBSave(RedisModuleIO *io, void *value)
 {
     zset *zs = (zset *)value;
-    zskiplist *zsl = zs->zsl;
 
-    RedisModule_SaveUnsigned(io, zsl->length);
+    RedisModule_SaveUnsigned(io, zsetLength(zs));
 
-    zskiplistNode *zn = zsl->tail;
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        unsigned char *zp = zs->zpk;
+        unsigned char *p = zpkLast(zp);
+        unsigned char *ele;
+        size_t len;
+        double score;
+        long long timestamp;
+
+        while (p != NULL) {
+            zpkGet(p,&ele,&len,&score,&timestamp);
+            RedisModule_SaveStringBuffer(io,(const char*)ele,len);
+            RedisModule_SaveDouble(io,score);
+            RedisModule_SaveSigned(io,(int64_t)timestamp);
+            p = zpkPrev(zp,p);
+        }
+        return;
+    }
+
+    zskiplistNode *zn = zs->zsl->tail;
     while (zn != NULL) {
         RedisModule_SaveStringBuffer(io,(const char*)zn->ele,sdslen(zn->ele));
         RedisModule_SaveDouble(io,zn->score);
-        RedisModule_SaveSigned(io,(int64_t)zn->timestamp);
+        RedisModule_SaveSigned(io,(int64_t)zslNodeTimestamp(zs->zsl,zn));
         zn = zn->backward;
     }
 }
@@ -28,25 +46,38 @@ void *zsetTsRDBLoad(RedisModuleIO *io, int encver)
 
     uint64_t zsetlen;
     zset *zs;
+    sds sdsele = sdsempty();
 
-    zsetlen = (unsigned int)RedisModule_LoadUnsigned(io);
-    zs = createZsetObject();
+    zsetlen = RedisModule_LoadUnsigned(io);
+    if (zsetlen > ztsConfig.zset_max_packed_entries)
+        zs = createZsetObject();
+    else
+        zs = createZsetPackedObject();
 
     while(zsetlen--) {
-        sds sdsele;
         double score;
         int64_t timestamp;
-        zskiplistNode *znode;
 
         size_t l = 0;
         char *cele = RedisModule_LoadStringBuffer(io, &l);
-        sdsele = sdsnewlen(cele, l);
+        sdsele = sdscpylen(sdsele, cele, l);
+        RedisModule_Free(cele);
         score = RedisModule_LoadDouble(io);
         timestamp = RedisModule_LoadSigned(io);
 
-        znode = zslInsert(zs->zsl,score,(long long)timestamp,sdsele);
-        dictAdd(zs->dict,sdsele,znode);
+        if (zs->encoding == ZSET_ENCODING_PACKED &&
+            l > ztsConfig.zset_max_packed_value)
+            zsetConvert(zs,ZSET_ENCODING_SKIPLIST);
+
+        if (zs->encoding == ZSET_ENCODING_PACKED) {
+            /* Elements are saved from the tail, so every insertion happens
+             * at the head of the packed list. */
+            zs->zpk = zzlInsert(zs->zpk,sdsele,score,(long long)timestamp);
+        } else {
+            zsetInsertNew(zs,score,(long long)timestamp,sdsele,NULL);
+        }
     }
+    sdsfree(sdsele);
 
     return zs;
 }
@@ -54,14 +85,31 @@ void *zsetTsRDBLoad(RedisModuleIO *io, int encver)
 void zsetTsAOFRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value)
 {
     zset *zs = (zset *)value;
-    zskiplist *zsl = zs->zsl;
     char buf[64];
 
-    zskiplistNode *zn = zsl->tail;
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        unsigned char *zp = zs->zpk;
+        unsigned char *p = zpkLast(zp);
+        unsigned char *ele;
+        size_t len;
+        double score;
+        long long timestamp;
+
+        while (p != NULL) {
+            zpkGet(p,&ele,&len,&score,&timestamp);
+            snprintf(buf, sizeof(buf), "%f", score);
+            RedisModule_EmitAOF(aof,"ZTS.ZADD","scclb",
+                    key,"TS",buf,timestamp,(const char*)ele,len);
+            p = zpkPrev(zp,p);
+        }
+        return;
+    }
+
+    zskiplistNode *zn = zs->zsl->tail;
     while (zn != NULL) {
         snprintf(buf, sizeof(buf), "%f", zn->score);
         RedisModule_EmitAOF(aof,"ZTS.ZADD","scclb",
-                key,"TS",buf,zn->timestamp,(const char*)zn->ele,sdslen(zn->ele));
+                key,"TS",buf,zslNodeTimestamp(zs->zsl,zn),(const char*)zn->ele,sdslen(zn->ele));
         zn = zn->backward;
     }
 }
@@ -0,0 +1,488 @@
+/* Counted B+tree index for the elements of a sorted set.
+ * See zbtree.h for the description of the data structure. */
+
+#include <string.h>
+#include "zsetts.h"
+#include "zbtree.h"
+#include "zmalloc.h"
+
+/* Leaves don't have the count and child arrays. */
+#define ZBT_LEAF_SIZE offsetof(zbtNode,count)
+
+static zbtNode *zbtCreateNode(zbtree *zbt, int leaf) {
+    zbtNode *n = zmalloc(leaf ? ZBT_LEAF_SIZE : sizeof(zbtNode));
+
+    n->leaf = leaf;
+    n->n = 0;
+    if (leaf) zbt->leaves++; else zbt->inners++;
+    return n;
+}
+
+/* Free a single node, which must not be referenced by the tree anymore. */
+static void zbtReleaseNode(zbtree *zbt, zbtNode *n) {
+    if (n->leaf) zbt->leaves--; else zbt->inners--;
+    zfree(n);
+}
+
+/* Create a new empty tree. */
+zbtree *zbtCreate(int intmembers) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+
+    zbt->leaves = zbt->inners = 0;
+    zbt->root = zbtCreateNode(zbt,1);
+    zbt->length = 0;
+    zbt->height = 1;
+    zbt->intmembers = intmembers;
+    return zbt;
+}
+
+static void zbtFreeNode(zbtNode *n) {
+    int j;
+
+    if (!n->leaf) {
+        for (j = 0; j < n->n; j++) zbtFreeNode(n->child[j]);
+    }
+    zfree(n);
+}
+
+/* Free the tree. The elements are owned by the skiplist and are not
+ * touched. */
+void zbtFree(zbtree *zbt) {
+    zbtFreeNode(zbt->root);
+    zfree(zbt);
+}
+
+/* Return the number of bytes allocated for the tree, elements excluded. */
+size_t zbtMemUsage(const zbtree *zbt) {
+    return sizeof(*zbt)+zbt->leaves*ZBT_LEAF_SIZE+zbt->inners*sizeof(zbtNode);
+}
+
+/* Compare the key 'i' of 'n' with the given element, using the ordering of
+ * the sorted set. Returns <0, 0 or >0 like memcmp(). 'order' is the order
+ * key of 'ele' (see zslMemberOrder()). */
+static int zbtCompare(zbtNode *n, int i, double score, long long timestamp, sds ele, uint64_t order) {
+    if (n->score[i] != score) return n->score[i] < score ? -1 : 1;
+    if (n->timestamp[i] != timestamp) return n->timestamp[i] > timestamp ? -1 : 1;
+    return zslCompareMember(n->ele[i],ele,order);
+}
+
+/* Number of elements stored under 'n'. */
+static unsigned long zbtNodeCount(zbtNode *n) {
+    unsigned long count = 0;
+    int j;
+
+    if (n->leaf) return n->n;
+    for (j = 0; j < n->n; j++) count += n->count[j];
+    return count;
+}
+
+/* Return the number of keys of 'n' that sort before the given element. */
+static int zbtLowerBound(zbtNode *n, double score, long long timestamp, sds ele, uint64_t order) {
+    int lo = 0, hi = n->n;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(n,mid,score,timestamp,ele,order) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Return the child of the inner node 'n' that may hold the given element,
+ * that is the last child whose first element is <= the element. */
+static int zbtChildFor(zbtNode *n, double score, long long timestamp, sds ele, uint64_t order) {
+    int lo = 1, hi = n->n;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(n,mid,score,timestamp,ele,order) <= 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo-1;
+}
+
+/* Copy 'num' slots of 'src' starting at 'si' into 'dst' at 'di'. The two
+ * ranges may overlap. */
+static void zbtMoveSlots(zbtNode *dst, int di, zbtNode *src, int si, int num) {
+    memmove(dst->score+di,src->score+si,num*sizeof(double));
+    memmove(dst->timestamp+di,src->timestamp+si,num*sizeof(long long));
+    memmove(dst->ele+di,src->ele+si,num*sizeof(zskiplistNode*));
+    if (!src->leaf) {
+        memmove(dst->count+di,src->count+si,num*sizeof(unsigned long));
+        memmove(dst->child+di,src->child+si,num*sizeof(zbtNode*));
+    }
+}
+
+/* Set the key 'i' of 'n' to the key 'j' of 'src'. */
+static void zbtSetKey(zbtNode *n, int i, zbtNode *src, int j) {
+    n->score[i] = src->score[j];
+    n->timestamp[i] = src->timestamp[j];
+    n->ele[i] = src->ele[j];
+}
+
+/* Open a hole at slot 'i' of 'n', which must not be full. */
+static void zbtOpenSlot(zbtNode *n, int i) {
+    zbtMoveSlots(n,i+1,n,i,n->n-i);
+    n->n++;
+}
+
+/* Remove the slot 'i' of 'n'. */
+static void zbtCloseSlot(zbtNode *n, int i) {
+    zbtMoveSlots(n,i,n,i+1,n->n-i-1);
+    n->n--;
+}
+
+/* Move the upper half of the full node 'n' into a new sibling, which is
+ * returned. */
+static zbtNode *zbtSplit(zbtree *zbt, zbtNode *n) {
+    zbtNode *right = zbtCreateNode(zbt,n->leaf);
+    int half = n->n/2;
+
+    zbtMoveSlots(right,0,n,half,n->n-half);
+    right->n = n->n-half;
+    n->n = half;
+    return right;
+}
+
+/* The first key of the node at depth 'depth' of the path changed: update
+ * the ancestors that use it as separator. */
+static void zbtUpdateFirstKey(zbtNode **path, int *idx, int depth, zbtNode *n) {
+    while (depth-- > 0) {
+        zbtSetKey(path[depth],idx[depth],n,0);
+        if (idx[depth] != 0) break;
+        n = path[depth];
+    }
+}
+
+#define ZBT_EDGE_NONE -1  /* zbtInsertGeneric(): search the position. */
+#define ZBT_EDGE_FIRST 0
+#define ZBT_EDGE_LAST 1
+
+/* Implements zbtInsert() and zbtInsertEdge(). Unless 'edge' is
+ * ZBT_EDGE_NONE the element sorts before or after all the elements of the
+ * tree, so the tree is descended along its first or last children and no
+ * key is compared. */
+static zskiplistNode *zbtInsertGeneric(zbtree *zbt, zskiplistNode *x, double score, long long timestamp,
+                                       unsigned long *rank, int edge)
+{
+    zbtNode *path[ZBT_MAXDEPTH], *n = zbt->root, *left, *right, *target;
+    zskiplistNode *prev;
+    unsigned long traversed = 0;
+    uint64_t order = zslMemberOrder(zbt->intmembers,x->ele);
+    int idx[ZBT_MAXDEPTH], depth = 0, pos, i, j;
+
+    while (!n->leaf) {
+        if (edge == ZBT_EDGE_NONE)
+            i = zbtChildFor(n,score,timestamp,x->ele,order);
+        else
+            i = edge == ZBT_EDGE_LAST ? n->n-1 : 0;
+        for (j = 0; j < i; j++) traversed += n->count[j];
+        n->count[i]++;
+        path[depth] = n;
+        idx[depth++] = i;
+        n = n->child[i];
+    }
+    if (edge == ZBT_EDGE_NONE)
+        pos = zbtLowerBound(n,score,timestamp,x->ele,order);
+    else
+        pos = edge == ZBT_EDGE_LAST ? n->n : 0;
+    if (pos > 0)
+        prev = n->ele[pos-1];
+    else
+        prev = n->n ? n->ele[0]->backward : NULL;
+    if (rank) *rank = traversed+pos+1;
+
+    /* Insert in the leaf, splitting it if it is full. */
+    right = NULL;
+    target = n;
+    if (n->n == ZBT_FANOUT) {
+        right = zbtSplit(zbt,n);
+        if (pos > n->n) {
+            pos -= n->n;
+            target = right;
+        }
+    }
+    zbtOpenSlot(target,pos);
+    target->score[pos] = score;
+    target->timestamp[pos] = timestamp;
+    target->ele[pos] = x;
+    if (target == n && pos == 0) zbtUpdateFirstKey(path,idx,depth,n);
+    zbt->length++;
+
+    /* Propagate the split towards the root. */
+    left = n;
+    while (right) {
+        zbtNode *parent;
+
+        if (depth == 0) {
+            zbtNode *root = zbtCreateNode(zbt,0);
+            root->n = 2;
+            zbtSetKey(root,0,left,0);
+            zbtSetKey(root,1,right,0);
+            root->child[0] = left;
+            root->child[1] = right;
+            root->count[0] = zbtNodeCount(left);
+            root->count[1] = zbtNodeCount(right);
+            zbt->root = root;
+            zbt->height++;
+            break;
+        }
+        parent = path[--depth];
+        i = idx[depth]+1;
+        parent->count[i-1] = zbtNodeCount(left);
+        target = parent;
+        n = NULL;
+        if (parent->n == ZBT_FANOUT) {
+            n = zbtSplit(zbt,parent);
+            if (i > parent->n) {
+                i -= parent->n;
+                target = n;
+            }
+        }
+        zbtOpenSlot(target,i);
+        zbtSetKey(target,i,right,0);
+        target->child[i] = right;
+        target->count[i] = zbtNodeCount(right);
+        left = parent;
+        right = n;
+    }
+    return prev;
+}
+
+/* Insert the skiplist node 'x', holding the element with the given score
+ * and timestamp, in the tree. The element must not already be inside. If
+ * 'rank' is not NULL it is set to the 1-based rank of the new element.
+ * Returns the element preceding the new one, or NULL if it was inserted in
+ * the first position: the caller uses it to link 'x' at level 0 of the
+ * skiplist. */
+zskiplistNode *zbtInsert(zbtree *zbt, zskiplistNode *x, double score, long long timestamp, unsigned long *rank) {
+    return zbtInsertGeneric(zbt,x,score,timestamp,rank,ZBT_EDGE_NONE);
+}
+
+/* Like zbtInsert(), for an element that sorts after all the elements of
+ * the tree when 'last' is true, or before all of them otherwise. This is
+ * up to the caller to check. */
+zskiplistNode *zbtInsertEdge(zbtree *zbt, zskiplistNode *x, double score, long long timestamp, int last) {
+    return zbtInsertGeneric(zbt,x,score,timestamp,NULL,last ? ZBT_EDGE_LAST : ZBT_EDGE_FIRST);
+}
+
+/* Remove the child 'i' of the inner node at depth 'depth' of the path,
+ * without freeing it. */
+static void zbtRemoveChild(zbtNode **path, int *idx, int depth, int i) {
+    zbtNode *parent = path[depth];
+
+    zbtCloseSlot(parent,i);
+    if (i == 0 && parent->n) zbtUpdateFirstKey(path,idx,depth,parent);
+}
+
+/* Append all the slots of 'src' to 'dst', then free 'src'. */
+static void zbtMerge(zbtree *zbt, zbtNode *dst, zbtNode *src) {
+    zbtMoveSlots(dst,dst->n,src,0,src->n);
+    dst->n += src->n;
+    zbtReleaseNode(zbt,src);
+}
+
+/* Called after an element was removed under the node 'n', at depth 'depth'
+ * of the path: merge 'n' with a sibling if they both fit in a single node,
+ * and go up the tree while nodes become empty or get merged. */
+static void zbtRebalance(zbtree *zbt, zbtNode **path, int *idx, int depth, zbtNode *n) {
+    while (depth > 0 && n->n < ZBT_FANOUT/2) {
+        zbtNode *parent = path[depth-1];
+        int i = idx[depth-1];
+
+        if (n->n == 0) {
+            zbtRemoveChild(path,idx,depth-1,i);
+            zbtReleaseNode(zbt,n);
+        } else if (i > 0 && parent->child[i-1]->n+n->n <= ZBT_FANOUT) {
+            zbtNode *left = parent->child[i-1];
+            zbtMerge(zbt,left,n);
+            parent->count[i-1] = zbtNodeCount(left);
+            zbtRemoveChild(path,idx,depth-1,i);
+        } else if (i+1 < parent->n && parent->child[i+1]->n+n->n <= ZBT_FANOUT) {
+            zbtMerge(zbt,n,parent->child[i+1]);
+            parent->count[i] = zbtNodeCount(n);
+            zbtRemoveChild(path,idx,depth-1,i+1);
+        } else {
+            break;
+        }
+        n = parent;
+        depth--;
+    }
+
+    /* Shrink the tree when the root is left with a single child. */
+    while (!zbt->root->leaf && zbt->root->n <= 1) {
+        zbtNode *root = zbt->root;
+        zbt->root = root->n ? root->child[0] : zbtCreateNode(zbt,1);
+        zbt->height = root->n ? zbt->height-1 : 1;
+        zbtReleaseNode(zbt,root);
+    }
+}
+
+/* Delete the element with matching score/timestamp/member from the tree.
+ * Returns the skiplist node of the element, which is not freed, or NULL if
+ * the element was not found. */
+zskiplistNode *zbtDelete(zbtree *zbt, double score, long long timestamp, sds ele) {
+    zbtNode *path[ZBT_MAXDEPTH], *n = zbt->root;
+    zskiplistNode *x;
+    uint64_t order = zslMemberOrder(zbt->intmembers,ele);
+    int idx[ZBT_MAXDEPTH], depth = 0, pos, j;
+
+    while (!n->leaf) {
+        path[depth] = n;
+        idx[depth] = zbtChildFor(n,score,timestamp,ele,order);
+        n = n->child[idx[depth++]];
+    }
+    pos = zbtLowerBound(n,score,timestamp,ele,order);
+    if (pos == n->n || zbtCompare(n,pos,score,timestamp,ele,order) != 0)
+        return NULL; /* not found */
+
+    x = n->ele[pos];
+    zbtCloseSlot(n,pos);
+    for (j = 0; j < depth; j++) path[j]->count[idx[j]]--;
+    if (pos == 0 && n->n) zbtUpdateFirstKey(path,idx,depth,n);
+    zbt->length--;
+    zbtRebalance(zbt,path,idx,depth,n);
+    return x;
+}
+
+/* Change the key of the element with matching score/timestamp/member to
+ * 'newscore' and 'newtimestamp', that must sort at the same position. Returns
+ * the skiplist node of the element, or NULL if it was not found. */
+zskiplistNode *zbtUpdateKey(zbtree *zbt, double score, long long timestamp, sds ele,
+                            double newscore, long long newtimestamp)
+{
+    zbtNode *path[ZBT_MAXDEPTH], *n = zbt->root;
+    uint64_t order = zslMemberOrder(zbt->intmembers,ele);
+    int idx[ZBT_MAXDEPTH], depth = 0, pos;
+
+    while (!n->leaf) {
+        path[depth] = n;
+        idx[depth] = zbtChildFor(n,score,timestamp,ele,order);
+        n = n->child[idx[depth++]];
+    }
+    pos = zbtLowerBound(n,score,timestamp,ele,order);
+    if (pos == n->n || zbtCompare(n,pos,score,timestamp,ele,order) != 0)
+        return NULL; /* not found */
+
+    n->score[pos] = newscore;
+    n->timestamp[pos] = newtimestamp;
+    if (pos == 0) zbtUpdateFirstKey(path,idx,depth,n);
+    return n->ele[pos];
+}
+
+/* Find the rank for an element by score, timestamp and member.
+ * Returns 0 when the element cannot be found, the 1-based rank otherwise. */
+unsigned long zbtGetRank(zbtree *zbt, double score, long long timestamp, sds ele) {
+    zbtNode *n = zbt->root;
+    unsigned long rank = 0;
+    uint64_t order = zslMemberOrder(zbt->intmembers,ele);
+    int i, j, pos;
+
+    while (!n->leaf) {
+        i = zbtChildFor(n,score,timestamp,ele,order);
+        for (j = 0; j < i; j++) rank += n->count[j];
+        n = n->child[i];
+    }
+    pos = zbtLowerBound(n,score,timestamp,ele,order);
+    if (pos == n->n || zbtCompare(n,pos,score,timestamp,ele,order) != 0) return 0;
+    return rank+pos+1;
+}
+
+/* Finds an element by its rank. The rank argument needs to be 1-based. */
+zskiplistNode *zbtGetElementByRank(zbtree *zbt, unsigned long rank) {
+    zbtNode *n = zbt->root;
+    int i;
+
+    if (rank == 0 || rank > zbt->length) return NULL;
+    while (!n->leaf) {
+        for (i = 0; rank > n->count[i]; i++) rank -= n->count[i];
+        n = n->child[i];
+    }
+    return n->ele[rank-1];
+}
+
+/* Return the last element for which 'pred' holds, or NULL if it holds for
+ * no element. If 'rank' is not NULL it is set to the 1-based rank of the
+ * returned element (0 when NULL is returned). */
+zskiplistNode *zbtLastMatching(zbtree *zbt, zbtPredicate pred, void *privdata, unsigned long *rank) {
+    zbtNode *n = zbt->root;
+    unsigned long traversed = 0;
+    int lo, hi, j;
+
+    while (1) {
+        /* Find the first key for which the predicate doesn't hold. Key 0 of
+         * inner nodes is never looked at: when no other key matches the
+         * answer can only be under the first child. */
+        lo = n->leaf ? 0 : 1;
+        hi = n->n;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (pred(n->score[mid],n->timestamp[mid],n->ele[mid],privdata))
+                lo = mid+1;
+            else
+                hi = mid;
+        }
+        if (n->leaf) break;
+        for (j = 0; j < lo-1; j++) traversed += n->count[j];
+        n = n->child[lo-1];
+    }
+    if (rank) *rank = lo ? traversed+lo : 0;
+    return lo ? n->ele[lo-1] : NULL;
+}
+
+/* Relocate, for defragmentation, the leaf holding the element of rank
+ * 'rank' (1-based), the inner nodes whose first leaf it is, and the elements
+ * of the leaf, so that a pass over all the leaves relocates every object of
+ * the tree once. 'defragnode' is called for the tree nodes and 'defragele'
+ * for the elements: both return the new address of the object, or NULL if
+ * it was not moved. References from the tree are updated here, any other
+ * is up to 'defragele'. Returns the rank of the first element of the next
+ * leaf, or 0 if this was the last leaf. */
+unsigned long zbtDefragLeaf(zbtree *zbt, unsigned long rank,
+                            zbtDefragNodeFunc defragnode,
+                            zbtDefragEleFunc defragele, void *privdata)
+{
+    zbtNode *path[ZBT_MAXDEPTH+1], *moved;
+    int idx[ZBT_MAXDEPTH], depth = 0, i, j, d;
+    unsigned long next = rank;
+
+    if (rank == 0 || rank > zbt->length) return 0;
+    path[0] = zbt->root;
+    while (!path[depth]->leaf) {
+        zbtNode *n = path[depth];
+
+        for (i = 0; rank > n->count[i]; i++) rank -= n->count[i];
+        idx[depth++] = i;
+        path[depth] = n->child[i];
+    }
+    next += path[depth]->n-(rank-1);
+
+    /* Relocate the leaf, then its ancestors as long as it is their first
+     * leaf, fixing the references of the parents as we go up. */
+    for (d = depth; d >= 0; d--) {
+        if ((moved = defragnode(path[d],privdata)) != NULL) {
+            path[d] = moved;
+            if (d == 0)
+                zbt->root = moved;
+            else
+                path[d-1]->child[idx[d-1]] = moved;
+        }
+        if (d > 0 && idx[d-1] != 0) break;
+    }
+
+    for (j = 0; j < path[depth]->n; j++) {
+        zskiplistNode *old = path[depth]->ele[j], *x = defragele(old,privdata);
+
+        if (x == NULL) continue;
+        path[depth]->ele[j] = x;
+        /* The first element of a node is the key of its slot in the parent,
+         * and so on up to the root. */
+        for (d = depth-1; j == 0 && d >= 0 && path[d]->ele[idx[d]] == old; d--)
+            path[d]->ele[idx[d]] = x;
+    }
+    return next > zbt->length ? 0 : next;
+}
@@ -0,0 +1,67 @@
+/* Counted B+tree index for the elements of a sorted set.
+ *
+ * This is an alternative to the skiplist towers, selected with the
+ * "zset-engine btree" module argument. The elements are still skiplist nodes
+ * linked at level 0 (so iterating a range is the same for both engines), but
+ * every search is served by an order-statistic B+tree: keys are kept inline
+ * in the tree nodes, so a descent only touches a few contiguous cache lines
+ * per level, and inner nodes keep the number of elements of every child to
+ * compute ranks.
+ *
+ * Elements are ordered like in the skiplist: score ascending, timestamp
+ * descending, member ascending. For both leaves and inner nodes key 'i' is
+ * the smallest element of the slot: the element itself for leaves, the first
+ * element of child 'i' for inner nodes. */
+
+#ifndef __ZSET_TS_ZBTREE_H
+#define __ZSET_TS_ZBTREE_H
+
+#include <stddef.h>
+#include "rmutil/sds.h"
+
+/* 16 keys of 8 bytes are two cache lines per key array. */
+#define ZBT_FANOUT 16
+#define ZBT_MAXDEPTH 32
+
+struct zskiplistNode;
+
+typedef struct zbtNode {
+    int leaf;   /* Leaf (slots are elements) or inner node. */
+    int n;      /* Number of used slots. */
+    double score[ZBT_FANOUT];
+    long long timestamp[ZBT_FANOUT];
+    struct zskiplistNode *ele[ZBT_FANOUT];
+    /* The following arrays are only allocated for inner nodes. */
+    unsigned long count[ZBT_FANOUT];
+    struct zbtNode *child[ZBT_FANOUT];
+} zbtNode;
+
+typedef struct zbtree {
+    zbtNode *root;
+    unsigned long length;
+    int height;
+    int intmembers; /* Compare members as integers, see zslCompareMember(). */
+    unsigned long leaves, inners;   /* Number of nodes of each kind. */
+} zbtree;
+
+/* Predicate for zbtLastMatching(): it must hold for a prefix of the
+ * elements, in order, and not hold for the rest. */
+typedef int (*zbtPredicate)(double score, long long timestamp, struct zskiplistNode *ele, void *privdata);
+
+/* Callbacks of zbtDefragLeaf(). */
+typedef struct zbtNode *(*zbtDefragNodeFunc)(struct zbtNode *n, void *privdata);
+typedef struct zskiplistNode *(*zbtDefragEleFunc)(struct zskiplistNode *x, void *privdata);
+
+zbtree *zbtCreate(int intmembers);
+void zbtFree(zbtree *zbt);
+size_t zbtMemUsage(const zbtree *zbt);
+struct zskiplistNode *zbtInsert(zbtree *zbt, struct zskiplistNode *x, double score, long long timestamp, unsigned long *rank);
+struct zskiplistNode *zbtInsertEdge(zbtree *zbt, struct zskiplistNode *x, double score, long long timestamp, int last);
+struct zskiplistNode *zbtDelete(zbtree *zbt, double score, long long timestamp, sds ele);
+struct zskiplistNode *zbtUpdateKey(zbtree *zbt, double score, long long timestamp, sds ele, double newscore, long long newtimestamp);
+unsigned long zbtGetRank(zbtree *zbt, double score, long long timestamp, sds ele);
+struct zskiplistNode *zbtGetElementByRank(zbtree *zbt, unsigned long rank);
+struct zskiplistNode *zbtLastMatching(zbtree *zbt, zbtPredicate pred, void *privdata, unsigned long *rank);
+unsigned long zbtDefragLeaf(zbtree *zbt, unsigned long rank, zbtDefragNodeFunc defragnode, zbtDefragEleFunc defragele, void *privdata);
+
+#endif // __ZSET_TS_ZBTREE_H
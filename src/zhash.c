@@ -0,0 +1,313 @@
+/* Intrusive hash index of the members of a sorted set.
+ * See zhash.h for an overview. The growth policy and the incremental
+ * rehashing follow the ones of dict.c. */
+
+#include <string.h>
+#include <limits.h>
+#include "zsetts.h"
+#include "zhash.h"
+#include "zmalloc.h"
+
+/* Hash of the member of 'node'. */
+static uint64_t zhashHashNode(zhash *zh, struct zskiplistNode *node) {
+    if (zh->intkeys) return dictGenIntHashFunction(zslNodeIntMember(node));
+    return dictGenHashFunction(node->ele,sdslen(node->ele));
+}
+
+/* A member to look up in the index. With integer keys the member is
+ * parsed once, then hashed and compared by value. */
+typedef struct zhashKey {
+    const char *ele;
+    size_t len;
+    uint64_t value;
+    uint64_t hash;
+} zhashKey;
+
+/* Prepare the lookup key for 'ele'. Returns 0 if the member can't be in
+ * the index, that is when integer keys are used and 'ele' is not one. */
+static int zhashInitKey(zhash *zh, zhashKey *key, const char *ele, size_t len) {
+    key->ele = ele;
+    key->len = len;
+    if (zh->intkeys) {
+        if (!zsetParseIntMember(ele,len,&key->value)) return 0;
+        key->hash = dictGenIntHashFunction(key->value);
+    } else {
+        key->hash = dictGenHashFunction(ele,len);
+    }
+    return 1;
+}
+
+static int zhashKeyMatch(zhash *zh, zhashKey *key, struct zskiplistNode *node) {
+    if (zh->intkeys) return zslNodeIntMember(node) == key->value;
+    return sdslen(node->ele) == key->len && memcmp(node->ele,key->ele,key->len) == 0;
+}
+
+static void _zhashReset(zhashTable *ht) {
+    ht->table = NULL;
+    ht->size = 0;
+    ht->sizemask = 0;
+    ht->used = 0;
+}
+
+/* Create a new, empty, hash index. When 'intkeys' is true all the members
+ * must be integers (see zsetParseIntMember()). */
+zhash *zhashCreate(int intkeys) {
+    zhash *zh = zmalloc(sizeof(*zh));
+
+    _zhashReset(&zh->ht[0]);
+    _zhashReset(&zh->ht[1]);
+    zh->rehashidx = -1;
+    zh->intkeys = intkeys;
+    return zh;
+}
+
+/* Release the index. The nodes are owned by the skiplist, so only the
+ * tables are freed here. */
+void zhashRelease(zhash *zh) {
+    zfree(zh->ht[0].table);
+    zfree(zh->ht[1].table);
+    zfree(zh);
+}
+
+/* Our hash table capability is a power of two */
+static unsigned long _zhashNextPower(unsigned long size) {
+    unsigned long i = ZHASH_INITIAL_SIZE;
+
+    if (size >= LONG_MAX) return LONG_MAX + 1LU;
+    while(1) {
+        if (i >= size)
+            return i;
+        i *= 2;
+    }
+}
+
+/* Expand or create the hash table */
+int zhashExpand(zhash *zh, unsigned long size) {
+    zhashTable n;
+    unsigned long realsize = _zhashNextPower(size);
+
+    /* the size is invalid if it is smaller than the number of
+     * elements already inside the hash table */
+    if (zhashIsRehashing(zh) || zh->ht[0].used > size)
+        return DICT_ERR;
+
+    /* Rehashing to the same table size is not useful. */
+    if (realsize == zh->ht[0].size) return DICT_ERR;
+
+    n.size = realsize;
+    n.sizemask = realsize-1;
+    n.table = zcalloc(realsize*sizeof(struct zskiplistNode*));
+    n.used = 0;
+
+    /* Is this the first initialization? If so it's not really a rehashing
+     * we just set the first hash table so that it can accept keys. */
+    if (zh->ht[0].table == NULL) {
+        zh->ht[0] = n;
+        return DICT_OK;
+    }
+
+    /* Prepare a second hash table for incremental rehashing */
+    zh->ht[1] = n;
+    zh->rehashidx = 0;
+    return DICT_OK;
+}
+
+/* Resize the table to the minimal size that contains all the elements,
+ * but with the invariant of a USED/BUCKETS ratio near to <= 1 */
+int zhashResize(zhash *zh) {
+    unsigned long minimal;
+
+    if (zhashIsRehashing(zh)) return DICT_ERR;
+    minimal = zh->ht[0].used;
+    if (minimal < ZHASH_INITIAL_SIZE)
+        minimal = ZHASH_INITIAL_SIZE;
+    return zhashExpand(zh, minimal);
+}
+
+/* Performs N steps of incremental rehashing. Returns 1 if there are still
+ * keys to move from the old to the new hash table, otherwise 0 is returned.
+ * As in dictRehash(), at most N*10 empty buckets are visited. */
+int zhashRehash(zhash *zh, int n) {
+    int empty_visits = n*10; /* Max number of empty buckets to visit. */
+
+    if (!zhashIsRehashing(zh)) return 0;
+
+    while(n-- && zh->ht[0].used != 0) {
+        struct zskiplistNode *node, *nextnode;
+
+        while(zh->ht[0].table[zh->rehashidx] == NULL) {
+            zh->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        node = zh->ht[0].table[zh->rehashidx];
+        /* Move all the nodes in this bucket from the old to the new table */
+        while(node) {
+            uint64_t h;
+
+            nextnode = node->hnext;
+            h = zhashHashNode(zh,node) & zh->ht[1].sizemask;
+            node->hnext = zh->ht[1].table[h];
+            zh->ht[1].table[h] = node;
+            zh->ht[0].used--;
+            zh->ht[1].used++;
+            node = nextnode;
+        }
+        zh->ht[0].table[zh->rehashidx] = NULL;
+        zh->rehashidx++;
+    }
+
+    /* Check if we already rehashed the whole table... */
+    if (zh->ht[0].used == 0) {
+        zfree(zh->ht[0].table);
+        zh->ht[0] = zh->ht[1];
+        _zhashReset(&zh->ht[1]);
+        zh->rehashidx = -1;
+        return 0;
+    }
+
+    /* More to rehash... */
+    return 1;
+}
+
+static void _zhashRehashStep(zhash *zh) {
+    zhashRehash(zh,1);
+}
+
+/* Expand the hash table if needed */
+static void _zhashExpandIfNeeded(zhash *zh) {
+    /* Incremental rehashing already in progress. Return. */
+    if (zhashIsRehashing(zh)) return;
+
+    /* If the hash table is empty expand it to the initial size. */
+    if (zh->ht[0].size == 0) {
+        zhashExpand(zh, ZHASH_INITIAL_SIZE);
+        return;
+    }
+
+    /* If we reached the 1:1 ratio, double the number of buckets. */
+    if (zh->ht[0].used >= zh->ht[0].size)
+        zhashExpand(zh, zh->ht[0].used*2);
+}
+
+/* Return the node holding the member 'ele', or NULL if there is none. */
+struct zskiplistNode *zhashFind(zhash *zh, const char *ele, size_t len) {
+    struct zskiplistNode *node;
+    zhashKey key;
+    uint64_t idx, table;
+
+    if (zhashSize(zh) == 0) return NULL; /* dict is empty */
+    if (zhashIsRehashing(zh)) _zhashRehashStep(zh);
+    if (!zhashInitKey(zh,&key,ele,len)) return NULL;
+    for (table = 0; table <= 1; table++) {
+        idx = key.hash & zh->ht[table].sizemask;
+        node = zh->ht[table].table[idx];
+        while(node) {
+            if (zhashKeyMatch(zh,&key,node))
+                return node;
+            node = node->hnext;
+        }
+        if (!zhashIsRehashing(zh)) return NULL;
+    }
+    return NULL;
+}
+
+/* Prefetch the buckets where the member 'ele' is looked up, so that a
+ * later zhashFind() doesn't wait for them. */
+void zhashPrefetch(zhash *zh, const char *ele, size_t len) {
+    zhashKey key;
+    int table;
+
+    if (!zhashInitKey(zh,&key,ele,len)) return;
+    for (table = 0; table <= 1; table++) {
+        if (zh->ht[table].size)
+            __builtin_prefetch(&zh->ht[table].table[key.hash & zh->ht[table].sizemask]);
+    }
+}
+
+/* Link 'node' into the index. The member must not be already present. */
+void zhashAdd(zhash *zh, struct zskiplistNode *node) {
+    zhashTable *ht;
+    uint64_t idx;
+
+    if (zhashIsRehashing(zh)) _zhashRehashStep(zh);
+    _zhashExpandIfNeeded(zh);
+
+    /* If rehashing is in progress new nodes always go to the new table. */
+    ht = zhashIsRehashing(zh) ? &zh->ht[1] : &zh->ht[0];
+    idx = zhashHashNode(zh,node) & ht->sizemask;
+    node->hnext = ht->table[idx];
+    ht->table[idx] = node;
+    ht->used++;
+}
+
+/* Remove the node holding the member 'ele' from the index and return it,
+ * or return NULL if there is no such member. The node is not freed. */
+struct zskiplistNode *zhashUnlink(zhash *zh, const char *ele, size_t len) {
+    struct zskiplistNode *node, **ref;
+    zhashKey key;
+    uint64_t idx, table;
+
+    if (zhashSize(zh) == 0) return NULL;
+    if (zhashIsRehashing(zh)) _zhashRehashStep(zh);
+    if (!zhashInitKey(zh,&key,ele,len)) return NULL;
+    for (table = 0; table <= 1; table++) {
+        idx = key.hash & zh->ht[table].sizemask;
+        ref = &zh->ht[table].table[idx];
+        while((node = *ref) != NULL) {
+            if (zhashKeyMatch(zh,&key,node)) {
+                *ref = node->hnext;
+                node->hnext = NULL;
+                zh->ht[table].used--;
+                return node;
+            }
+            ref = &node->hnext;
+        }
+        if (!zhashIsRehashing(zh)) break;
+    }
+    return NULL;
+}
+
+/* Make the bucket slot that references 'oldnode' reference 'newnode'
+ * instead. The two nodes must hold the same member. Returns DICT_ERR if
+ * 'oldnode' is not linked into the index. */
+int zhashReplace(zhash *zh, struct zskiplistNode *oldnode, struct zskiplistNode *newnode) {
+    struct zskiplistNode **ref;
+    uint64_t h, table;
+
+    h = zhashHashNode(zh,oldnode);
+    for (table = 0; table <= 1; table++) {
+        if (zh->ht[table].size == 0) continue;
+        ref = &zh->ht[table].table[h & zh->ht[table].sizemask];
+        while(*ref) {
+            if (*ref == oldnode) {
+                newnode->hnext = oldnode->hnext;
+                *ref = newnode;
+                return DICT_OK;
+            }
+            ref = &(*ref)->hnext;
+        }
+    }
+    return DICT_ERR;
+}
+
+/* Make the bucket slot that references 'oldnode' reference 'newnode', a
+ * copy of it at a new address (see zsetDefrag()). 'oldnode' is a dead
+ * pointer and is never accessed. Returns DICT_ERR if it was not found. */
+int zhashRelocate(zhash *zh, struct zskiplistNode *oldnode, struct zskiplistNode *newnode) {
+    struct zskiplistNode **ref;
+    uint64_t h, table;
+
+    h = zhashHashNode(zh,newnode);
+    for (table = 0; table <= 1; table++) {
+        if (zh->ht[table].size == 0) continue;
+        ref = &zh->ht[table].table[h & zh->ht[table].sizemask];
+        while(*ref) {
+            if (*ref == oldnode) {
+                *ref = newnode;
+                return DICT_OK;
+            }
+            ref = &(*ref)->hnext;
+        }
+    }
+    return DICT_ERR;
+}
@@ -0,0 +1,53 @@
+/* Intrusive hash index of the members of a sorted set.
+ *
+ * This is an alternative to dict.c for the member -> node lookups of the
+ * dict+skiplist encoding, selected at build time with ZHASH=yes. Instead of
+ * allocating a dictEntry per member, buckets point directly to skiplist
+ * nodes and collisions are chained through the 'hnext' field of the nodes,
+ * so a lookup is one bucket probe plus one node touch (the member bytes are
+ * embedded in the node).
+ *
+ * Like dict.c, two tables are used to rehash incrementally: every lookup or
+ * update moves one bucket from the old to the new table, so that growing a
+ * large set never blocks the server. */
+
+#ifndef __ZSET_TS_ZHASH_H
+#define __ZSET_TS_ZHASH_H
+
+#include <stddef.h>
+
+struct zskiplistNode;
+
+typedef struct zhashTable {
+    struct zskiplistNode **table;
+    unsigned long size;
+    unsigned long sizemask;
+    unsigned long used;
+} zhashTable;
+
+typedef struct zhash {
+    zhashTable ht[2];
+    long rehashidx; /* rehashing not in progress if rehashidx == -1 */
+    int intkeys;    /* Members are integers, hashed and compared by value. */
+} zhash;
+
+/* This is the initial size of every hash table */
+#define ZHASH_INITIAL_SIZE 4
+
+#define zhashSlots(zh) ((zh)->ht[0].size+(zh)->ht[1].size)
+#define zhashSize(zh) ((zh)->ht[0].used+(zh)->ht[1].used)
+#define zhashIsRehashing(zh) ((zh)->rehashidx != -1)
+
+zhash *zhashCreate(int intkeys);
+void zhashRelease(zhash *zh);
+int zhashExpand(zhash *zh, unsigned long size);
+int zhashResize(zhash *zh);
+int zhashRehash(zhash *zh, int n);
+struct zskiplistNode *zhashFind(zhash *zh, const char *ele, size_t len);
+void zhashPrefetch(zhash *zh, const char *ele, size_t len);
+void zhashAdd(zhash *zh, struct zskiplistNode *node);
+struct zskiplistNode *zhashUnlink(zhash *zh, const char *ele, size_t len);
+int zhashReplace(zhash *zh, struct zskiplistNode *oldnode, struct zskiplistNode *newnode);
+int zhashRelocate(zhash *zh, struct zskiplistNode *oldnode, struct zskiplistNode *newnode);
+
+#endif // __ZSET_TS_ZHASH_H
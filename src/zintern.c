@@ -0,0 +1,123 @@
+/* Module wide intern table of sorted set members.
+ * See zintern.h for an overview. */
+
+#include <pthread.h>
+#include "zsetts.h"
+#include "zintern.h"
+#include "zmalloc.h"
+
+static zinternStats zinternStat;
+
+/* Interned members, indexed by the interned string itself. Sets can be
+ * released by background threads (see zlazyfree.h), so the table and the
+ * refcounts are protected by a mutex. */
+static dict *zinternDict = NULL;
+static pthread_mutex_t zinternMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static dictType zinternDictType = {
+    dictSdsHash,               /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictSdsKeyCompare,         /* key compare */
+    NULL,                      /* Note: strings freed by zinternRelease() */
+    NULL                       /* val destructor */
+};
+
+/* Bytes allocated before the SDS header of an interned member of 'len'
+ * bytes: the refcount, and the integer value for short members. */
+static size_t zinternPrefixSize(size_t len) {
+    size_t size = sizeof(unsigned long);
+
+    if (len <= ZSET_INT_MEMBER_MAXLEN) size += sizeof(uint64_t);
+    return size;
+}
+
+/* Return the start of the allocation holding the interned member 'ele'. */
+static unsigned long *zinternRefcount(sds ele) {
+    size_t len = sdslen(ele);
+
+    return (unsigned long*)(ele-zslEmbeddedHdrSize(len)-zinternPrefixSize(len));
+}
+
+/* Return the interned copy of 'ele', creating it if needed, and take a
+ * reference to it. The caller retains the ownership of 'ele' and must give
+ * the reference back with zinternRelease(). */
+sds zinternAcquire(sds ele) {
+    size_t len = sdslen(ele);
+    size_t elesize = zslEmbeddedHdrSize(len)+len+1;
+    dictEntry *de;
+    char *buf;
+    sds s;
+    uint64_t value;
+
+    pthread_mutex_lock(&zinternMutex);
+    if (zinternDict == NULL) zinternDict = dictCreate(&zinternDictType,NULL);
+    if ((de = dictFind(zinternDict,ele)) != NULL) {
+        s = dictGetKey(de);
+        (*zinternRefcount(s))++;
+        zinternStat.refs++;
+        zinternStat.saved += elesize;
+        pthread_mutex_unlock(&zinternMutex);
+        return s;
+    }
+
+    buf = zmalloc(zinternPrefixSize(len)+elesize);
+    *(unsigned long*)buf = 1;
+    s = zslEmbedEle(buf+zinternPrefixSize(len),ele,len);
+    if (len <= ZSET_INT_MEMBER_MAXLEN)
+        *(uint64_t*)(buf+sizeof(unsigned long)) =
+            zsetParseIntMember(ele,len,&value) ? value : 0;
+    dictAdd(zinternDict,s,NULL);
+    zinternStat.strings++;
+    zinternStat.refs++;
+    zinternStat.bytes += zinternPrefixSize(len)+elesize;
+    pthread_mutex_unlock(&zinternMutex);
+    return s;
+}
+
+/* Give back a reference taken with zinternAcquire(). The string is removed
+ * from the table and freed when its last reference goes away, and the table
+ * itself once it is empty. */
+void zinternRelease(sds ele) {
+    unsigned long *refcount = zinternRefcount(ele);
+    size_t len = sdslen(ele);
+    size_t elesize = zslEmbeddedHdrSize(len)+len+1;
+
+    pthread_mutex_lock(&zinternMutex);
+    zinternStat.refs--;
+    if (--(*refcount) > 0) {
+        zinternStat.saved -= elesize;
+        pthread_mutex_unlock(&zinternMutex);
+        return;
+    }
+    dictDelete(zinternDict,ele);
+    zinternStat.strings--;
+    zinternStat.bytes -= zinternPrefixSize(len)+elesize;
+    zfree(refcount);
+    if (dictSize(zinternDict) == 0) {
+        dictRelease(zinternDict);
+        zinternDict = NULL;
+    }
+    pthread_mutex_unlock(&zinternMutex);
+}
+
+/* Return the bytes of the interned member 'ele' charged to each of its
+ * references: the size of the string and of its entry in the table, split
+ * among them. */
+size_t zinternShareSize(sds ele) {
+    size_t len = sdslen(ele);
+    size_t size = zinternPrefixSize(len)+zslEmbeddedHdrSize(len)+len+1;
+
+    size += sizeof(dictEntry)+sizeof(dictEntry*);
+    pthread_mutex_lock(&zinternMutex);
+    size /= *zinternRefcount(ele);
+    pthread_mutex_unlock(&zinternMutex);
+    return size;
+}
+
+/* Copy the current statistics of the table to '*stats'. */
+void zinternGetStats(zinternStats *stats) {
+    pthread_mutex_lock(&zinternMutex);
+    *stats = zinternStat;
+    pthread_mutex_unlock(&zinternMutex);
+}
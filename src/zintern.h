@@ -0,0 +1,37 @@
+/* Module wide intern table of sorted set members.
+ *
+ * When the same member is stored in many keys (for instance a user ID that
+ * appears in per-feed, per-day and per-region leaderboards), every skiplist
+ * node normally embeds its own copy of the string. With interning enabled
+ * the nodes of non packed sets point instead to a single refcounted copy
+ * owned by this table, shared by all the keys.
+ *
+ * An interned member is allocated as:
+ *
+ *   [refcount][integer value][SDS header][member bytes]['\0']
+ *
+ * The integer value slot (see zsetParseIntMember()) is only present for
+ * members of at most ZSET_INT_MEMBER_MAXLEN bytes, so that sets of integer
+ * members find it at the same place as with embedded members.
+ *
+ * The table is thread safe, as sets can be released by background threads. */
+
+#ifndef __ZSET_TS_ZINTERN_H
+#define __ZSET_TS_ZINTERN_H
+
+#include "rmutil/sds.h"
+
+typedef struct zinternStats {
+    unsigned long strings;      /* Distinct members in the table. */
+    unsigned long long refs;    /* References held by skiplist nodes. */
+    size_t bytes;               /* Bytes allocated for the table strings. */
+    size_t saved;               /* Bytes of the private copies that the
+                                   references beyond the first would use. */
+} zinternStats;
+
+sds zinternAcquire(sds ele);
+void zinternRelease(sds ele);
+size_t zinternShareSize(sds ele);
+void zinternGetStats(zinternStats *stats);
+
+#endif // __ZSET_TS_ZINTERN_H
@@ -0,0 +1,73 @@
+/* Background release of large sorted sets.
+ * See zlazyfree.h for an overview. */
+
+#include <pthread.h>
+#include "zsetts.h"
+#include "zlazyfree.h"
+#include "zmalloc.h"
+
+typedef struct zlazyfreeJob {
+    zset *zs;
+    struct zlazyfreeJob *next;
+} zlazyfreeJob;
+
+static pthread_mutex_t zlazyfreeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zlazyfreeCond = PTHREAD_COND_INITIALIZER;
+static zlazyfreeJob *zlazyfreeHead = NULL, *zlazyfreeTail = NULL;
+static int zlazyfreeStarted = 0;
+
+/* Body of the background thread: release the queued sets, in order. */
+static void *zlazyfreeThread(void *arg) {
+    zlazyfreeJob *job;
+
+    DICT_NOTUSED(arg);
+    pthread_mutex_lock(&zlazyfreeMutex);
+    while(1) {
+        while (zlazyfreeHead == NULL)
+            pthread_cond_wait(&zlazyfreeCond,&zlazyfreeMutex);
+        job = zlazyfreeHead;
+        zlazyfreeHead = job->next;
+        if (zlazyfreeHead == NULL) zlazyfreeTail = NULL;
+        pthread_mutex_unlock(&zlazyfreeMutex);
+
+        zsetFreeNow(job->zs);
+        zfree(job);
+
+        pthread_mutex_lock(&zlazyfreeMutex);
+    }
+    return NULL;
+}
+
+/* Queue the detached set 'zs' to be released by the background thread,
+ * starting the thread on first use. If the thread can't be started the set
+ * is released synchronously. */
+void zsetLazyFree(zset *zs) {
+    zlazyfreeJob *job;
+
+    pthread_mutex_lock(&zlazyfreeMutex);
+    if (!zlazyfreeStarted) {
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread,&attr,zlazyfreeThread,NULL) != 0) {
+            pthread_attr_destroy(&attr);
+            pthread_mutex_unlock(&zlazyfreeMutex);
+            zsetFreeNow(zs);
+            return;
+        }
+        pthread_attr_destroy(&attr);
+        zlazyfreeStarted = 1;
+    }
+    job = zmalloc(sizeof(*job));
+    job->zs = zs;
+    job->next = NULL;
+    if (zlazyfreeTail)
+        zlazyfreeTail->next = job;
+    else
+        zlazyfreeHead = job;
+    zlazyfreeTail = job;
+    pthread_cond_signal(&zlazyfreeCond);
+    pthread_mutex_unlock(&zlazyfreeMutex);
+}
@@ -0,0 +1,26 @@
+/* Background release of large sorted sets.
+ *
+ * Freeing a set with millions of members walks and frees every node, which
+ * blocks the server for seconds. Redis can already release module values in
+ * its own background thread (UNLINK, lazyfree-lazy-* options) using the
+ * free_effort callback of the type, but a plain DEL or an overwrite with
+ * lazyfree disabled frees them synchronously. With the zset-lazy-free option
+ * the free callback hands large sets to a thread owned by the module
+ * instead, so that only detaching them happens in the caller.
+ *
+ * Everything reachable from a set is owned by the set, except interned
+ * members, and the intern table is thread safe, so a detached set can be
+ * released by any thread. */
+
+#ifndef __ZSET_TS_ZLAZYFREE_H
+#define __ZSET_TS_ZLAZYFREE_H
+
+#include "zsetts.h"
+
+/* Sets whose free effort is above this threshold are freed in the
+ * background, the same threshold Redis uses for its lazyfree. */
+#define ZSET_LAZYFREE_THRESHOLD 64
+
+void zsetLazyFree(zset *zs);
+
+#endif // __ZSET_TS_ZLAZYFREE_H
@@ -0,0 +1,220 @@
+/* Packed encoding for small ZSetWithT values.
+ * See zpack.h for the description of the memory layout. */
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "zpack.h"
+#include "zmalloc.h"
+
+#define ZPK_HDR_SIZE (sizeof(uint32_t)*2)
+#define ZPK_BIGLEN 254
+#define ZPK_DATA_SIZE (sizeof(double)+sizeof(int64_t))
+
+#define ZPK_BYTES(zp) (*((uint32_t*)(zp)))
+#define ZPK_LENGTH(zp) (*((uint32_t*)((zp)+sizeof(uint32_t))))
+#define ZPK_END(zp) ((zp)+ZPK_BYTES(zp))
+
+/* Bytes used to encode a member length of 'len', both for <len>
+ * and <backlen>. */
+static size_t zpkLenSize(size_t len) {
+    return len < ZPK_BIGLEN ? 1 : 1+sizeof(uint32_t);
+}
+
+/* Total bytes used by an entry holding a member of 'len' bytes. */
+static size_t zpkEntrySize(size_t len) {
+    return zpkLenSize(len)*2+len+ZPK_DATA_SIZE;
+}
+
+/* Decode the member length of the entry at 'p'. */
+static size_t zpkDecodeLen(unsigned char *p) {
+    uint32_t len;
+
+    if (p[0] < ZPK_BIGLEN) return p[0];
+    memcpy(&len,p+1,sizeof(len));
+    return len;
+}
+
+/* Decode the member length of the entry ending right before 'p'. */
+static size_t zpkDecodeBackLen(unsigned char *p) {
+    uint32_t len;
+
+    if (p[-1] < ZPK_BIGLEN) return p[-1];
+    memcpy(&len,p-1-sizeof(len),sizeof(len));
+    return len;
+}
+
+static size_t zpkRawEntrySize(unsigned char *p) {
+    return zpkEntrySize(zpkDecodeLen(p));
+}
+
+/* Write an entry at 'p', which must have room for zpkEntrySize(len). */
+static void zpkWriteEntry(unsigned char *p, const unsigned char *ele, size_t len,
+        double score, long long timestamp)
+{
+    uint32_t len32 = len;
+    int64_t ts = timestamp;
+
+    if (len < ZPK_BIGLEN) {
+        *p++ = len;
+    } else {
+        *p++ = ZPK_BIGLEN;
+        memcpy(p,&len32,sizeof(len32));
+        p += sizeof(len32);
+    }
+    memcpy(p,ele,len);
+    p += len;
+    memcpy(p,&score,sizeof(score));
+    p += sizeof(score);
+    memcpy(p,&ts,sizeof(ts));
+    p += sizeof(ts);
+    if (len < ZPK_BIGLEN) {
+        *p = len;
+    } else {
+        memcpy(p,&len32,sizeof(len32));
+        p[sizeof(len32)] = ZPK_BIGLEN;
+    }
+}
+
+/* Create a new empty zpack. */
+unsigned char *zpkNew(void) {
+    unsigned char *zp = zmalloc(ZPK_HDR_SIZE);
+    ZPK_BYTES(zp) = ZPK_HDR_SIZE;
+    ZPK_LENGTH(zp) = 0;
+    return zp;
+}
+
+void zpkFree(unsigned char *zp) {
+    zfree(zp);
+}
+
+/* Return the total number of bytes used by the zpack. */
+size_t zpkBlobLen(unsigned char *zp) {
+    return ZPK_BYTES(zp);
+}
+
+/* Return the number of entries. */
+unsigned long zpkLen(unsigned char *zp) {
+    return ZPK_LENGTH(zp);
+}
+
+/* Return the first / last entry, or NULL if the zpack is empty. */
+unsigned char *zpkFirst(unsigned char *zp) {
+    return ZPK_LENGTH(zp) ? zp+ZPK_HDR_SIZE : NULL;
+}
+
+unsigned char *zpkLast(unsigned char *zp) {
+    unsigned char *end = ZPK_END(zp);
+
+    if (ZPK_LENGTH(zp) == 0) return NULL;
+    return end-zpkEntrySize(zpkDecodeBackLen(end));
+}
+
+/* Return the entry after / before 'p', or NULL at the tail / head. */
+unsigned char *zpkNext(unsigned char *zp, unsigned char *p) {
+    p += zpkRawEntrySize(p);
+    return (p == ZPK_END(zp)) ? NULL : p;
+}
+
+unsigned char *zpkPrev(unsigned char *zp, unsigned char *p) {
+    if (p == zp+ZPK_HDR_SIZE) return NULL;
+    return p-zpkEntrySize(zpkDecodeBackLen(p));
+}
+
+/* Return the entry at the 0-based 'index'. Negative indexes are taken
+ * starting from the tail, -1 being the last entry. Returns NULL when the
+ * index is out of range. */
+unsigned char *zpkSeek(unsigned char *zp, long index) {
+    unsigned char *p;
+
+    if (index < 0) {
+        index = (-index)-1;
+        if ((unsigned long)index >= ZPK_LENGTH(zp)) return NULL;
+        p = zpkLast(zp);
+        while (p && index--) p = zpkPrev(zp,p);
+    } else {
+        if ((unsigned long)index >= ZPK_LENGTH(zp)) return NULL;
+        p = zpkFirst(zp);
+        while (p && index--) p = zpkNext(zp,p);
+    }
+    return p;
+}
+
+/* Fetch the fields of the entry at 'p'. Any output pointer can be NULL.
+ * The member is returned as a pointer inside the zpack, so it is only
+ * valid until the next modification. */
+void zpkGet(unsigned char *p, unsigned char **ele, size_t *len, double *score, long long *timestamp) {
+    size_t l = zpkDecodeLen(p);
+    unsigned char *data = p+zpkLenSize(l);
+
+    if (ele) *ele = data;
+    if (len) *len = l;
+    data += l;
+    if (score) memcpy(score,data,sizeof(double));
+    if (timestamp) {
+        int64_t ts;
+        memcpy(&ts,data+sizeof(double),sizeof(ts));
+        *timestamp = ts;
+    }
+}
+
+/* Return 1 if the member of the entry at 'p' is equal to 'ele'. */
+int zpkEqualMember(unsigned char *p, const unsigned char *ele, size_t len) {
+    size_t l = zpkDecodeLen(p);
+
+    if (l != len) return 0;
+    return memcmp(p+zpkLenSize(l),ele,len) == 0;
+}
+
+/* Insert a new entry before the entry at 'p', or at the tail if 'p' is
+ * NULL. Returns the (possibly reallocated) zpack. */
+unsigned char *zpkInsert(unsigned char *zp, unsigned char *p, const unsigned char *ele, size_t len, double score, long long timestamp) {
+    size_t oldbytes = ZPK_BYTES(zp);
+    size_t reqlen = zpkEntrySize(len);
+    size_t offset = p ? (size_t)(p-zp) : oldbytes;
+
+    assert(oldbytes+reqlen <= UINT32_MAX);
+    zp = zrealloc(zp,oldbytes+reqlen);
+    p = zp+offset;
+    memmove(p+reqlen,p,oldbytes-offset);
+    zpkWriteEntry(p,ele,len,score,timestamp);
+    ZPK_BYTES(zp) = oldbytes+reqlen;
+    ZPK_LENGTH(zp)++;
+    return zp;
+}
+
+/* Delete the entry at '*p'. On return '*p' points to the entry that was
+ * following the deleted one (NULL if it was the tail), so that it is
+ * possible to delete entries while iterating. */
+unsigned char *zpkDelete(unsigned char *zp, unsigned char **p) {
+    size_t offset = *p-zp;
+    size_t dellen = zpkRawEntrySize(*p);
+    size_t oldbytes = ZPK_BYTES(zp);
+
+    memmove(*p,*p+dellen,oldbytes-offset-dellen);
+    ZPK_BYTES(zp) = oldbytes-dellen;
+    ZPK_LENGTH(zp)--;
+    zp = zrealloc(zp,oldbytes-dellen);
+    *p = (offset == ZPK_BYTES(zp)) ? NULL : zp+offset;
+    return zp;
+}
+
+/* Delete 'num' consecutive entries starting at the 0-based 'index'. */
+unsigned char *zpkDeleteRange(unsigned char *zp, long index, unsigned long num) {
+    unsigned char *first = zpkSeek(zp,index), *p;
+    size_t offset, dellen, oldbytes = ZPK_BYTES(zp);
+    unsigned long deleted = 0;
+
+    if (first == NULL) return zp;
+    p = first;
+    while (p < ZPK_END(zp) && deleted < num) {
+        p += zpkRawEntrySize(p);
+        deleted++;
+    }
+    offset = first-zp;
+    dellen = p-first;
+    memmove(first,p,oldbytes-offset-dellen);
+    ZPK_BYTES(zp) = oldbytes-dellen;
+    ZPK_LENGTH(zp) -= deleted;
+    return zrealloc(zp,oldbytes-dellen);
+}
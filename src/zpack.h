@@ -0,0 +1,41 @@
+/* Packed encoding for small ZSetWithT values.
+ *
+ * A zpack is a single contiguous allocation holding (member, score,
+ * timestamp) records back to back. The ordering of the records is up to the
+ * caller: this file only knows how to walk, insert and delete entries, the
+ * sorted set semantic lives in zsetts.c (see the zzl* functions).
+ *
+ * Layout:
+ *
+ * <total-bytes:uint32> <entries:uint32> <entry> <entry> ... <entry>
+ *
+ * Every entry is:
+ *
+ * <len> <member bytes> <score:double> <timestamp:int64> <backlen>
+ *
+ * <len> is one byte when the member is shorter than ZPK_BIGLEN, otherwise it
+ * is the ZPK_BIGLEN marker followed by the length as uint32. <backlen> is the
+ * same information stored in reverse order (uint32 first, then the marker)
+ * so that the list can be traversed from tail to head too. */
+
+#ifndef __ZSET_TS_ZPACK_H
+#define __ZSET_TS_ZPACK_H
+
+#include <stddef.h>
+
+unsigned char *zpkNew(void);
+void zpkFree(unsigned char *zp);
+size_t zpkBlobLen(unsigned char *zp);
+unsigned long zpkLen(unsigned char *zp);
+unsigned char *zpkFirst(unsigned char *zp);
+unsigned char *zpkLast(unsigned char *zp);
+unsigned char *zpkNext(unsigned char *zp, unsigned char *p);
+unsigned char *zpkPrev(unsigned char *zp, unsigned char *p);
+unsigned char *zpkSeek(unsigned char *zp, long index);
+void zpkGet(unsigned char *p, unsigned char **ele, size_t *len, double *score, long long *timestamp);
+int zpkEqualMember(unsigned char *p, const unsigned char *ele, size_t len);
+unsigned char *zpkInsert(unsigned char *zp, unsigned char *p, const unsigned char *ele, size_t len, double score, long long timestamp);
+unsigned char *zpkDelete(unsigned char *zp, unsigned char **p);
+unsigned char *zpkDeleteRange(unsigned char *zp, long index, unsigned long num);
+
+#endif // __ZSET_TS_ZPACK_H
@@ -1,9 +1,15 @@
 #include "zsetts.h"
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
+#include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/time.h>
+#include <unistd.h>
 #include "zmalloc.h"
+#include "zpack.h"
+#include "zlazyfree.h"
 
 void serverAssertWithInfo(RedisModuleCtx *c, const void *o, const char *estr, const char *file, int line) {
 	RedisModule_Log(c,"warning","=== ASSERTION FAILED ===");
@@ -29,14 +35,22 @@ sds sdsFromRedisModuleString(sds s, RedisModuleString *m)
     return s;
 }
 
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
 /*-----------------------------------------------------------------------------
  *  zsetDictType related definition from redis 4.0
  *----------------------------------------------------------------------------*/
 /* Error codes */
 #define C_ERR                   -1
 
-#define ZSKIPLIST_MAXLEVEL 32 /* Should be enough for 2^32 elements */
-#define ZSKIPLIST_P 0.25      /* Skiplist P = 1/4 */
+#define ZSKIPLIST_P_BITS 2    /* Skiplist P = 1/4 = 1/2^ZSKIPLIST_P_BITS */
+#define ZSET_MEM_USAGE_SAMPLES 64 /* Nodes measured by zsetMemUsage() */
+#define ZADD_PREFETCH_DISTANCE 8 /* Members ZADD looks up in advance. */
 
 /* Input flags. */
 #define ZADD_NONE 0
@@ -54,9 +68,12 @@ sds sdsFromRedisModuleString(sds s, RedisModuleString *m)
 /* Flags only used by the ZADD command but not by zsetAdd() API: */
 #define ZADD_CH (1<<16)      /* Return num of elements added or updated. */
 
-/* Struct to hold a inclusive/exclusive range spec by score comparison. */
+/* Struct to hold a inclusive/exclusive range spec by score comparison, or
+ * by score and timestamp comparison. The bounds are stored as ordering keys
+ * (see zslMakeKey()), compared with the keys of the elements, so both kinds
+ * of ranges follow the order of the set. See zslParseRange(). */
 typedef struct {
-    double min, max;
+    zslKey min, max;
     int minex, maxex; /* are min or max exclusive? */
 } zrangespec;
 
@@ -92,6 +109,28 @@ dictType zsetDictType = {
     NULL                       /* val destructor */
 };
 
+uint64_t dictIntMemberHash(const void *key) {
+    return dictGenIntHashFunction(*(const uint64_t*)key);
+}
+
+int dictIntMemberKeyCompare(void *privdata, const void *key1,
+        const void *key2)
+{
+    DICT_NOTUSED(privdata);
+    return *(const uint64_t*)key1 == *(const uint64_t*)key2;
+}
+
+/* Hash of sorted sets with integer members: keys point to the value of the
+ * members, stored in the skiplist nodes. */
+dictType zsetIntDictType = {
+    dictIntMemberHash,         /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictIntMemberKeyCompare,   /* key compare */
+    NULL,                      /* Note: value stored in the skiplist node */
+    NULL                       /* val destructor */
+};
+
 /* Hash table parameters */
 #define HASHTABLE_MIN_FILL        10      /* Minimal hash table fill 10% */
 
@@ -104,67 +143,644 @@ int htNeedsResize(dict *dict) {
             (used*100/size < HASHTABLE_MIN_FILL));
 }
 
+/*-----------------------------------------------------------------------------
+ * Integer members. Sets of the dict+skiplist encoding created while the
+ * zset-int-members option is enabled store the value of their members in
+ * the skiplist nodes, as long as all the members are integers, and use it
+ * to hash and order them. Sets fall back to string members for good as
+ * soon as any other member is added.
+ *----------------------------------------------------------------------------*/
+
+const uint64_t zslPow10[ZSET_INT_MEMBER_MAXLEN+1] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/* Return 1 if 's' is an integer member and set '*value' to its value,
+ * otherwise return 0. Integer members are the non negative decimal numbers
+ * written in canonical form, without sign or leading zeros, and with at most
+ * ZSET_INT_MEMBER_MAXLEN digits: "0" and "12345" are integer members,
+ * "007", "-1" and "+1" are not. So the string is always the decimal
+ * representation of the value and one can be turned into the other. */
+int zsetParseIntMember(const char *s, size_t len, uint64_t *value) {
+    uint64_t v = 0;
+    size_t j;
+
+    if (len == 0 || len > ZSET_INT_MEMBER_MAXLEN || (s[0] == '0' && len > 1))
+        return 0;
+    for (j = 0; j < len; j++) {
+        if (s[j] < '0' || s[j] > '9') return 0;
+        v = v*10+(s[j]-'0');
+    }
+    *value = v;
+    return 1;
+}
+
+#ifdef ZSET_MEMBER_PREFIX
+/* Return the first 8 bytes of 'ele', padded with zeros, as a big endian
+ * integer. Two members with different prefixes compare like the strings:
+ * where a prefix has padding the other member has either padding too or a
+ * byte following the shorter member, which sorts after it. */
+static uint64_t zslMemberPrefix(sds ele) {
+    unsigned char buf[8] = {0};
+    size_t len = sdslen(ele);
+    uint64_t prefix = 0;
+    int j;
+
+    memcpy(buf,ele,len < sizeof(buf) ? len : sizeof(buf));
+    for (j = 0; j < 8; j++) prefix = (prefix << 8) | buf[j];
+    return prefix;
+}
+#endif
+
+/* Return the order key of 'ele', used by zslCompareMember(), or
+ * ZSL_ORDER_NONE if 'intmembers' is false or 'ele' is not an integer.
+ *
+ * Members are ordered as strings, so the value of the member can't be used
+ * directly ("10" < "9"). Padding the digits with zeros on the right up to
+ * ZSET_INT_MEMBER_MAXLEN digits gives instead an integer with the same
+ * order as the strings, the only ties being members that differ by trailing
+ * zeros ("1", "10", "100"), which are ordered by length.
+ *
+ * When built with ZSET_MEMBER_PREFIX the members of sets without integer
+ * members have an order key too: their prefix (see zslMemberPrefix()). */
+uint64_t zslMemberOrder(int intmembers, sds ele) {
+    uint64_t value;
+    size_t len = sdslen(ele);
+
+#ifdef ZSET_MEMBER_PREFIX
+    if (!intmembers) return zslMemberPrefix(ele);
+#endif
+    if (!intmembers || !zsetParseIntMember(ele,len,&value))
+        return ZSL_ORDER_NONE;
+    return value*zslPow10[ZSET_INT_MEMBER_MAXLEN-len];
+}
+
+/*-----------------------------------------------------------------------------
+ * Member index of the dict+skiplist encoding. Maps every member to its
+ * skiplist node, using dict.c or, when built with ZHASH=yes, the intrusive
+ * hash of zhash.c.
+ *----------------------------------------------------------------------------*/
+
+#ifdef ZSET_USE_ZHASH
+
+zsetDict *zsetDictCreate(int intmembers) {
+    return zhashCreate(intmembers);
+}
+
+void zsetDictRelease(zsetDict *d) {
+    zhashRelease(d);
+}
+
+void zsetDictExpand(zsetDict *d, unsigned long size) {
+    zhashExpand(d,size);
+}
+
+unsigned long zsetDictSize(zsetDict *d) {
+    return zhashSize(d);
+}
+
+/* Return the node of member 'ele', or NULL if it is not in the set. */
+zskiplistNode *zsetDictFind(zsetDict *d, sds ele) {
+    return zhashFind(d,ele,sdslen(ele));
+}
+
+/* Prefetch the buckets where member 'ele' is looked up. */
+void zsetDictPrefetch(zsetDict *d, const char *ele, size_t len) {
+    zhashPrefetch(d,ele,len);
+}
+
+/* Index 'node', whose member must not be already present. */
+void zsetDictAdd(zsetDict *d, zskiplistNode *node) {
+    zhashAdd(d,node);
+}
+
+/* Remove member 'ele' from the index, returning its node (which is not
+ * freed) or NULL if the member was not found. */
+zskiplistNode *zsetDictDelete(zsetDict *d, sds ele) {
+    return zhashUnlink(d,ele,sdslen(ele));
+}
+
+/* Make the index point to 'newnode' instead of 'oldnode', both holding
+ * the same member. */
+void zsetDictReplace(zsetDict *d, zskiplistNode *oldnode, zskiplistNode *newnode) {
+    serverAssert(zhashReplace(d,oldnode,newnode) == DICT_OK);
+}
+
+/* Shrink the index after deletions if it became too sparse. */
+void zsetDictResizeIfNeeded(zsetDict *d) {
+    long long size = zhashSlots(d), used = zhashSize(d);
+
+    if (size > ZHASH_INITIAL_SIZE && used*100/size < HASHTABLE_MIN_FILL)
+        zhashResize(d);
+}
+
+/* Allocations to free to release the index: the nodes are the entries. */
+size_t zsetDictFreeEffort(zsetDict *d) {
+    DICT_NOTUSED(d);
+    return 1;
+}
+
+/* Bytes allocated for the index: the nodes are the entries. */
+size_t zsetDictMemUsage(zsetDict *d) {
+    return sizeof(*d)+zhashSlots(d)*sizeof(zskiplistNode*);
+}
+
+/* Relocate the index and its tables, returning its new address. */
+zsetDict *zsetDictDefragTables(RedisModuleDefragCtx *ctx, zsetDict *d) {
+    zsetDict *newd;
+    void *newtable;
+    int j;
+
+    if ((newd = RedisModule_DefragAlloc(ctx,d)) != NULL) d = newd;
+    for (j = 0; j <= 1; j++) {
+        if (d->ht[j].table &&
+            (newtable = RedisModule_DefragAlloc(ctx,d->ht[j].table)) != NULL)
+            d->ht[j].table = newtable;
+    }
+    return d;
+}
+
+/* Relocate the entries of one bucket of the index: there is nothing to do,
+ * the nodes are the entries. */
+unsigned long zsetDictDefragEntries(RedisModuleDefragCtx *ctx, zsetDict *d, unsigned long cursor) {
+    DICT_NOTUSED(ctx);
+    DICT_NOTUSED(d);
+    DICT_NOTUSED(cursor);
+    return 0;
+}
+
+/* Make the index reference 'newnode', the new address of the relocated
+ * node 'oldnode'. */
+void zsetDictRelocate(zsetDict *d, zskiplistNode *oldnode, zskiplistNode *newnode, int embedded) {
+    DICT_NOTUSED(embedded);
+    serverAssert(zhashRelocate(d,oldnode,newnode) == DICT_OK);
+}
+
+#else
+
+zsetDict *zsetDictCreate(int intmembers) {
+    return dictCreate(intmembers ? &zsetIntDictType : &zsetDictType,NULL);
+}
+
+void zsetDictRelease(zsetDict *d) {
+    dictRelease(d);
+}
+
+void zsetDictExpand(zsetDict *d, unsigned long size) {
+    dictExpand(d,size);
+}
+
+unsigned long zsetDictSize(zsetDict *d) {
+    return dictSize(d);
+}
+
+/* Key of the entry of 'node': the member embedded in the node, or the
+ * value stored in the node for integer members. */
+static void *zsetDictNodeKey(zsetDict *d, zskiplistNode *node) {
+    return d->type == &zsetIntDictType ? (void*)&zslNodeIntMember(node) : node->ele;
+}
+
+/* Return the node of member 'ele', or NULL if it is not in the set. */
+zskiplistNode *zsetDictFind(zsetDict *d, sds ele) {
+    dictEntry *de;
+    uint64_t value;
+
+    if (d->type == &zsetIntDictType) {
+        if (!zsetParseIntMember(ele,sdslen(ele),&value)) return NULL;
+        de = dictFind(d,&value);
+    } else {
+        de = dictFind(d,ele);
+    }
+    return de ? dictGetVal(de) : NULL;
+}
+
+/* Prefetch the buckets where member 'ele' is looked up. The hash is the
+ * one of the dict type of the index. */
+void zsetDictPrefetch(zsetDict *d, const char *ele, size_t len) {
+    uint64_t value;
+
+    if (d->type == &zsetIntDictType) {
+        if (!zsetParseIntMember(ele,len,&value)) return;
+        dictPrefetch(d,dictGenIntHashFunction(value));
+    } else {
+        dictPrefetch(d,dictGenHashFunction(ele,len));
+    }
+}
+
+/* Index 'node', whose member must not be already present. The key of the
+ * entry is the member embedded in the node. */
+void zsetDictAdd(zsetDict *d, zskiplistNode *node) {
+    serverAssert(dictAdd(d,zsetDictNodeKey(d,node),node) == DICT_OK);
+}
+
+/* Remove member 'ele' from the index, returning its node (which is not
+ * freed) or NULL if the member was not found. */
+zskiplistNode *zsetDictDelete(zsetDict *d, sds ele) {
+    dictEntry *de;
+    zskiplistNode *node;
+    uint64_t value;
+
+    if (d->type == &zsetIntDictType) {
+        if (!zsetParseIntMember(ele,sdslen(ele),&value)) return NULL;
+        de = dictUnlink(d,&value);
+    } else {
+        de = dictUnlink(d,ele);
+    }
+
+    if (de == NULL) return NULL;
+    node = dictGetVal(de);
+    dictFreeUnlinkedEntry(d,de);
+    return node;
+}
+
+/* Make the index point to 'newnode' instead of 'oldnode', both holding
+ * the same member. The key is updated too, since it is embedded in the
+ * node. */
+void zsetDictReplace(zsetDict *d, zskiplistNode *oldnode, zskiplistNode *newnode) {
+    dictEntry *de = dictFind(d,zsetDictNodeKey(d,oldnode));
+
+    serverAssert(de != NULL);
+    dictGetVal(de) = newnode;
+    dictSetKey(d,de,zsetDictNodeKey(d,newnode));
+}
+
+/* Shrink the index after deletions if it became too sparse. */
+void zsetDictResizeIfNeeded(zsetDict *d) {
+    if (htNeedsResize(d)) dictResize(d);
+}
+
+/* Allocations to free to release the index, one per entry. */
+size_t zsetDictFreeEffort(zsetDict *d) {
+    return dictSize(d);
+}
+
+/* Bytes allocated for the index, tables and entries. */
+size_t zsetDictMemUsage(zsetDict *d) {
+    return sizeof(*d)+dictSlots(d)*sizeof(dictEntry*)+dictSize(d)*sizeof(dictEntry);
+}
+
+/* Relocate the dict and its tables, returning its new address. */
+zsetDict *zsetDictDefragTables(RedisModuleDefragCtx *ctx, zsetDict *d) {
+    zsetDict *newd;
+    dictEntry **newtable;
+    int j;
+
+    if ((newd = RedisModule_DefragAlloc(ctx,d)) != NULL) d = newd;
+    for (j = 0; j <= 1; j++) {
+        if (d->ht[j].table &&
+            (newtable = RedisModule_DefragAlloc(ctx,d->ht[j].table)) != NULL)
+            d->ht[j].table = newtable;
+    }
+    return d;
+}
+
+static void zsetDefragDictEntry(void *privdata, const dictEntry *de) {
+    DICT_NOTUSED(privdata);
+    DICT_NOTUSED(de);
+}
+
+/* Relocate the entries of a bucket, fixing the references of the bucket
+ * and of the previous entries of the chain. */
+static void zsetDefragDictBucket(void *privdata, dictEntry **bucketref) {
+    RedisModuleDefragCtx *ctx = privdata;
+    dictEntry *newde;
+
+    while (*bucketref) {
+        if ((newde = RedisModule_DefragAlloc(ctx,*bucketref)) != NULL)
+            *bucketref = newde;
+        bucketref = &(*bucketref)->next;
+    }
+}
+
+/* Relocate the entries of the buckets at the dictScan() cursor 'cursor',
+ * returning the next cursor, or 0 when all the buckets were visited. */
+unsigned long zsetDictDefragEntries(RedisModuleDefragCtx *ctx, zsetDict *d, unsigned long cursor) {
+    return dictScan(d,cursor,zsetDefragDictEntry,zsetDefragDictBucket,ctx);
+}
+
+/* Make the dict reference 'newnode', the new address of the relocated node
+ * 'oldnode', which is a dead pointer. If 'embedded' the key of the entry is
+ * stored in the node itself, and moved with it. */
+void zsetDictRelocate(zsetDict *d, zskiplistNode *oldnode, zskiplistNode *newnode, int embedded) {
+    char *newkey = zsetDictNodeKey(d,newnode);
+    const void *oldkey = newkey;
+    dictEntry **deref;
+
+    if (embedded) oldkey = (char*)oldnode+(newkey-(char*)newnode);
+    deref = dictFindEntryRefByPtrAndHash(d,oldkey,dictGetHash(d,newkey));
+    serverAssert(deref != NULL);
+    dictSetKey(d,*deref,newkey);
+    dictSetVal(d,*deref,newnode);
+}
+
+#endif
+
 /*-----------------------------------------------------------------------------
  *  rewrite necessary functions from redis 4.0
  *----------------------------------------------------------------------------*/
 
-zskiplist *zslCreate(void);
+/* Set up the empty dict+skiplist of 'zs', using the configured engine and
+ * allocation policy. */
+static void zsetInitSkiplist(zset *zs, int intmembers) {
+    zs->encoding = ZSET_ENCODING_SKIPLIST;
+    zs->zpk = NULL;
+    zs->dict = zsetDictCreate(intmembers);
+    zs->zsl = zslCreate(ztsConfig.zset_engine,ztsConfig.zset_node_pool,intmembers,
+                       ztsConfig.zset_intern_members);
+}
 
 zset *createZsetObject(void) {
     zset *zs = zmalloc(sizeof(*zs));
 
-    zs->dict = dictCreate(&zsetDictType,NULL);
-    zs->zsl = zslCreate();
+    zsetInitSkiplist(zs,ztsConfig.zset_int_members);
+    return zs;
+}
+
+zset *createZsetPackedObject(void) {
+    zset *zs = zmalloc(sizeof(*zs));
+
+    zs->encoding = ZSET_ENCODING_PACKED;
+    zs->zpk = zpkNew();
+    zs->dict = NULL;
+    zs->zsl = NULL;
     return zs;
 }
 
-void zslFree(zskiplist *zsl);
+/* Release the set and everything it owns. This may be called from any
+ * thread (see zlazyfree.h). */
+void zsetFreeNow(zset *zs) {
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        zpkFree(zs->zpk);
+    } else {
+        zsetDictRelease(zs->dict);
+        zslFree(zs->zsl);
+    }
+    zfree(zs);
+}
+
+/* Return the number of allocations to free to release the set, like the
+ * free effort of native objects: the nodes, or the slabs when they are
+ * pooled, plus the entries of the member index and the B+tree nodes. */
+size_t zsetFreeEffort(RedisModuleString *key, const void *value) {
+    const zset *zs = value;
+    zskiplist *zsl = zs->zsl;
+    size_t effort;
+
+    DICT_NOTUSED(key);
+    if (zs->encoding == ZSET_ENCODING_PACKED) return 1;
+    effort = zsetDictFreeEffort(zs->dict);
+    if (zsl->pool)
+        effort += zsl->pool->slab_count+zsl->pool->large_objs;
+    else
+        effort += zsl->length;
+    if (zsl->zbt) effort += zsl->zbt->leaves+zsl->zbt->inners;
+    return effort;
+}
+
+/* Type free callback. With zset-lazy-free large sets are released by the
+ * background thread of the module. */
 void freeZsetObject(void *o) {
     zset *zs = (zset *)o;
-    dictRelease(zs->dict);
-    zslFree(zs->zsl);
-    zfree(zs);
+
+    if (ztsConfig.zset_lazy_free &&
+        zsetFreeEffort(NULL,zs) > ZSET_LAZYFREE_THRESHOLD)
+        zsetLazyFree(zs);
+    else
+        zsetFreeNow(zs);
 }
 
 /*-----------------------------------------------------------------------------
  * Skiplist implementation of the low level API from redis 4.0
  *----------------------------------------------------------------------------*/
 
+/* Return the size of the SDS header used to embed a member of 'len' bytes
+ * inside a skiplist node. Embedded strings are never resized, so the
+ * smallest header able to represent 'len' is used. */
+size_t zslEmbeddedHdrSize(size_t len) {
+    if (len < 1<<5) return sizeof(struct sdshdr5);
+    if (len < 1<<8) return sizeof(struct sdshdr8);
+    if (len < 1<<16) return sizeof(struct sdshdr16);
+    if (len < 1ll<<32) return sizeof(struct sdshdr32);
+    return sizeof(struct sdshdr64);
+}
+
+/* Build an SDS string holding a copy of 'ele' at 'buf', which must have
+ * room for zslEmbeddedHdrSize(len)+len+1 bytes. */
+sds zslEmbedEle(char *buf, const char *ele, size_t len) {
+    sds s;
+
+    if (len < 1<<5) {
+        s = buf+sizeof(struct sdshdr5);
+        s[-1] = SDS_TYPE_5 | (len << SDS_TYPE_BITS);
+    } else if (len < 1<<8) {
+        struct sdshdr8 *sh = (void*)buf;
+        sh->len = sh->alloc = len;
+        sh->flags = SDS_TYPE_8;
+        s = sh->buf;
+    } else if (len < 1<<16) {
+        struct sdshdr16 *sh = (void*)buf;
+        sh->len = sh->alloc = len;
+        sh->flags = SDS_TYPE_16;
+        s = sh->buf;
+    } else if (len < 1ll<<32) {
+        struct sdshdr32 *sh = (void*)buf;
+        sh->len = sh->alloc = len;
+        sh->flags = SDS_TYPE_32;
+        s = sh->buf;
+    } else {
+        struct sdshdr64 *sh = (void*)buf;
+        sh->len = sh->alloc = len;
+        sh->flags = SDS_TYPE_64;
+        s = sh->buf;
+    }
+    memcpy(s,ele,len);
+    s[len] = '\0';
+    return s;
+}
+
+#ifdef ZSET_COMPACT_TS
+/* Half of the range of the timestamp offsets. */
+#define ZSL_TS_HALF (1ULL<<31)
+
+/* Return 'timestamp' minus 'delta', clamped to LLONG_MIN. */
+static long long zslTimestampSub(long long timestamp, unsigned long long delta) {
+    if ((unsigned long long)timestamp-(unsigned long long)LLONG_MIN < delta)
+        return LLONG_MIN;
+    return (long long)((unsigned long long)timestamp-delta);
+}
+
+/* Move the base of the timestamp offsets to 'tsbase', rewriting the offset
+ * of every node that is not escaped. */
+static void zslRebaseTimestamps(zskiplist *zsl, long long tsbase) {
+    unsigned long long shift = (unsigned long long)zsl->tsbase-(unsigned long long)tsbase;
+    zskiplistNode *x;
+
+    for (x = zsl->header->level[0].forward; x; x = x->level[0].forward) {
+        if (x->level[0].tsoffset != ZSL_TS_ESCAPE)
+            x->level[0].tsoffset = (uint32_t)(x->level[0].tsoffset+shift);
+    }
+    zsl->tsbase = tsbase;
+}
+
+/* Return the offset to store in a new node of 'zsl' for 'timestamp'. When
+ * the timestamp is out of the range of the current base, the nodes are
+ * rebased so that the new timestamp and all the ones stored since the
+ * skiplist was last empty are in range, with the free room split between
+ * both ends. If this is not possible ZSL_TS_ESCAPE is returned and the
+ * caller must store the full timestamp in the node. */
+static uint32_t zslTimestampOffset(zskiplist *zsl, long long timestamp) {
+    if (zsl->length == 0) {
+        zsl->tsbase = zslTimestampSub(timestamp,ZSL_TS_HALF);
+        zsl->tsmin = zsl->tsmax = timestamp;
+    } else if (timestamp < zsl->tsbase ||
+               (unsigned long long)timestamp-(unsigned long long)zsl->tsbase >= ZSL_TS_ESCAPE)
+    {
+        long long lo = timestamp < zsl->tsmin ? timestamp : zsl->tsmin;
+        long long hi = timestamp > zsl->tsmax ? timestamp : zsl->tsmax;
+        unsigned long long span = (unsigned long long)hi-(unsigned long long)lo;
+
+        if (span >= ZSL_TS_ESCAPE) return ZSL_TS_ESCAPE;
+        zslRebaseTimestamps(zsl,zslTimestampSub(lo,(ZSL_TS_ESCAPE-1-span)/2));
+    }
+    if (timestamp < zsl->tsmin) zsl->tsmin = timestamp;
+    if (timestamp > zsl->tsmax) zsl->tsmax = timestamp;
+    return (uint32_t)((unsigned long long)timestamp-(unsigned long long)zsl->tsbase);
+}
+#endif
+
 /* Create a skiplist node with the specified number of levels.
- * The SDS string 'ele' is referenced by the node after the call. */
-zskiplistNode *zslCreateNode(int level, double score, sds ele, long long timestamp) {
-    zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
+ * The member is copied inside the node, right after the level array, as an
+ * SDS string that node->ele points to: a member costs a single allocation
+ * and the bytes compared on ties live next to the node itself. The caller
+ * retains the ownership of 'ele'. When 'ele' is NULL (the header node) the
+ * node has no member. Nodes with a member are allocated from the slab pool
+ * of 'zsl' when it has one. In skiplists of integer members 'ele' must be
+ * an integer member, and its value is stored before the embedded string.
+ * In skiplists with interned members the node references the interned copy
+ * of 'ele' instead. */
+zskiplistNode *zslCreateNode(zskiplist *zsl, int level, double score, sds ele, long long timestamp) {
+    int embed = ele && !zsl->interned;
+    size_t len = ele ? sdslen(ele) : 0;
+    size_t elesize = embed ? zslEmbeddedHdrSize(len)+len+1 : 0;
+    size_t intsize = (embed && zsl->intmembers) ? sizeof(uint64_t) : 0;
+    size_t size = sizeof(zskiplistNode)+level*sizeof(struct zskiplistLevel)+intsize+elesize;
+    size_t prefix = 0;
+    zskiplistNode *zn;
+    uint64_t value = 0;
+    char *buf;
+#ifdef ZSET_COMPACT_TS
+    uint32_t tsoffset = ele ? zslTimestampOffset(zsl,timestamp) : 0;
+
+    if (tsoffset == ZSL_TS_ESCAPE) prefix = sizeof(timestamp);
+#endif
+
+    if (intsize) serverAssert(zsetParseIntMember(ele,len,&value));
+    if (ele) zsl->churn++;
+    buf = (embed && zsl->pool) ? zslabAlloc(zsl->pool,prefix+size) : zmalloc(prefix+size);
+    zn = (zskiplistNode*)(buf+prefix);
     zn->score = score;
-    zn->ele = ele;
+    if (!ele)
+        zn->ele = NULL;
+    else if (zsl->interned)
+        zn->ele = zinternAcquire(ele);
+    else
+        zn->ele = zslEmbedEle((char*)(zn->level+level)+intsize,ele,len);
+    if (intsize) zslNodeIntMember(zn) = value;
+#ifdef ZSET_MEMBER_PREFIX
+    zn->order = ele ? zslMemberOrder(zsl->intmembers,ele) : 0;
+#endif
+#ifdef ZSET_COMPACT_TS
+    zn->level[0].tsoffset = tsoffset;
+    if (tsoffset == ZSL_TS_ESCAPE) memcpy(buf,&timestamp,sizeof(timestamp));
+#else
     zn->timestamp = timestamp;
+#endif
     return zn;
 }
 
-/* Create a new skiplist. */
-zskiplist *zslCreate(void) {
+/* Return the number of bytes allocated before the node 'x'. */
+static size_t zslNodePrefixSize(zskiplistNode *x) {
+#ifdef ZSET_COMPACT_TS
+    if (x->ele && x->level[0].tsoffset == ZSL_TS_ESCAPE) return sizeof(long long);
+#else
+    DICT_NOTUSED(x);
+#endif
+    return 0;
+}
+
+/* Return the number of bytes allocated for the node 'x', which can't be the
+ * header nor reference an interned member: the embedded member is the last
+ * field of the node. */
+static size_t zslNodeSize(zskiplistNode *x) {
+    return zslNodePrefixSize(x)+(size_t)(x->ele-(char*)x)+sdslen(x->ele)+1;
+}
+
+/* Return the number of bytes used by the node 'x' of 'zsl', which can't be
+ * the header nor be pooled. The size of the allocation is asked to the
+ * allocator, so that the rounding to its size classes is accounted for, as
+ * zsetCompact() reports the difference with pooled nodes. Nodes referencing
+ * an interned member are also charged for their share of the string. */
+static size_t zslNodeMemUsage(zskiplist *zsl, zskiplistNode *x) {
+    size_t size = RedisModule_MallocSize((char*)x-zslNodePrefixSize(x));
+
+    if (zsl->interned) size += zinternShareSize(x->ele);
+    return size;
+}
+
+/* Create a new skiplist. With the ZSET_ENGINE_BTREE engine the searches are
+ * served by a counted B+tree and the nodes are only linked at level 0. When
+ * 'pooled' is true the nodes are allocated from a slab pool owned by the
+ * skiplist (see zslab.h). When 'intmembers' is true all the members must be
+ * integers, and are ordered by value (see zslMemberOrder()). When
+ * 'interned' is true the nodes reference the members in the intern table.
+ * Such nodes have no member bytes to find their size from, so they are
+ * never pooled. */
+zskiplist *zslCreate(int engine, int pooled, int intmembers, int interned) {
     int j;
     zskiplist *zsl;
 
     zsl = zmalloc(sizeof(*zsl));
     zsl->level = 1;
     zsl->length = 0;
-    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,NULL,0);
+    zsl->pool = (pooled && !interned) ? zslabCreate() : NULL;
+    zsl->intmembers = intmembers;
+    zsl->interned = interned;
+    zsl->churn = 0;
+    memset(zsl->cursor,0,sizeof(zsl->cursor));
+    zsl->nextcursor = 0;
+    zsl->cursor_hits = zsl->cursor_misses = 0;
+#ifdef ZSET_COMPACT_TS
+    zsl->tsbase = zsl->tsmin = zsl->tsmax = 0;
+#endif
+    zsl->header = zslCreateNode(zsl,ZSKIPLIST_MAXLEVEL,0,NULL,0);
     for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
         zsl->header->level[j].forward = NULL;
-        zsl->header->level[j].span = 0;
+        zslSetSpan(zsl->header,j,0);
     }
     zsl->header->backward = NULL;
     zsl->tail = NULL;
+    for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++)
+        zsl->rightmost[j] = zsl->header;
+    zsl->zbt = (engine == ZSET_ENGINE_BTREE) ? zbtCreate(intmembers) : NULL;
     return zsl;
 }
 
-/* Free the specified skiplist node. The referenced SDS string representation
- * of the element is freed too, unless node->ele is set to NULL before calling
- * this function. */
-void zslFreeNode(zskiplistNode *node) {
-    sdsfree(node->ele);
-    zfree(node);
+/* Free the specified skiplist node, together with the member embedded in
+ * it, or the reference to its interned member. */
+void zslFreeNode(zskiplist *zsl, zskiplistNode *node) {
+    char *buf = (char*)node-zslNodePrefixSize(node);
+
+    zsl->churn++;
+    if (zsl->pool) {
+        zslabFree(zsl->pool,buf,zslNodeSize(node));
+    } else {
+        if (zsl->interned) zinternRelease(node->ele);
+        zfree(buf);
+    }
 }
 
 /* Free a whole skiplist. */
@@ -172,81 +788,261 @@ void zslFree(zskiplist *zsl) {
     zskiplistNode *node = zsl->header->level[0].forward, *next;
 
     zfree(zsl->header);
-    while(node) {
-        next = node->level[0].forward;
-        zslFreeNode(node);
-        node = next;
+    if (zsl->pool) {
+        /* Pooled nodes go away with their slabs: only the nodes that were
+         * too big to be pooled need to be freed one by one. */
+        while(node && zsl->pool->large_objs) {
+            next = node->level[0].forward;
+            if (zslNodeSize(node) > ZSLAB_MAX_OBJ) zslFreeNode(zsl,node);
+            node = next;
+        }
+        zslabRelease(zsl->pool);
+    } else {
+        while(node) {
+            next = node->level[0].forward;
+            zslFreeNode(zsl,node);
+            node = next;
+        }
     }
+    if (zsl->zbt) zbtFree(zsl->zbt);
     zfree(zsl);
 }
 
+/* State of the xorshift64* generator of the skiplist levels. Nodes are only
+ * created by the main thread, so unlike random() it needs no lock. */
+static uint64_t zslRandomState;
+
+/* Seed the generator of the skiplist levels. With the same seed the same
+ * sequence of insertions builds skiplists of the same shape, which makes
+ * benchmarks reproducible. A seed of 0 picks one from the clock and the
+ * pid. */
+void zslSeedRandom(uint64_t seed) {
+    uint64_t z;
+
+    if (seed == 0) seed = (uint64_t)ustime() ^ ((uint64_t)getpid() << 32);
+    /* Spread the bits of the seed with a splitmix64 step, so that small
+     * seeds are good starting states. The state must not be 0. */
+    z = seed+0x9E3779B97F4A7C15ULL;
+    z = (z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+    z = (z^(z>>27))*0x94D049BB133111EBULL;
+    z ^= z>>31;
+    zslRandomState = z ? z : 0x9E3779B97F4A7C15ULL;
+#ifdef ZSET_LIBC_RANDOM
+    srandom((unsigned int)z);
+#endif
+}
+
+static inline uint64_t zslRandom(void) {
+    uint64_t x = zslRandomState;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    zslRandomState = x;
+    return x*0x2545F4914F6CDD1DULL;
+}
+
 /* Returns a random level for the new skiplist node we are going to create.
  * The return value of this function is between 1 and ZSKIPLIST_MAXLEVEL
  * (both inclusive), with a powerlaw-alike distribution where higher
- * levels are less likely to be returned. */
+ * levels are less likely to be returned. The level is taken from a single
+ * draw: every ZSKIPLIST_P_BITS leading zero bits add a level. */
 int zslRandomLevel(void) {
-    int level = 1;
-    while ((random()&0xFFFF) < (ZSKIPLIST_P * 0xFFFF))
+    uint64_t r;
+    int level;
+
+    if (zslRandomState == 0) zslSeedRandom(0);
+#ifdef ZSET_LIBC_RANDOM
+    /* The random() loop of Redis, one call per level. Only built by
+     * tools/Makefile to measure it against xorshift64*. */
+    (void)r;
+    level = 1;
+    while ((random()&0xFFFF) <= (0xFFFF >> ZSKIPLIST_P_BITS))
         level += 1;
+#else
+    r = zslRandom();
+    level = r ? 1+__builtin_clzll(r)/ZSKIPLIST_P_BITS : ZSKIPLIST_MAXLEVEL;
+#endif
     return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
 }
 
-#define COMPARE_NODE_LT(_n, _score, _ts, _ele) \
-    ((_n)->score < (_score) || \
-     ((_n)->score == (_score) && (_n)->timestamp > (_ts)) || \
-     ((_n)->score == (_score) && (_n)->timestamp == (_ts) && sdscmp((_n)->ele,(_ele)) < 0))
-#define COMPARE_NODE_LTE(_n, _score, _ts, _ele) \
-    ((_n)->score < (_score) || \
-     ((_n)->score == (_score) && (_n)->timestamp > (_ts)) || \
-     ((_n)->score == (_score) && (_n)->timestamp == (_ts) && sdscmp((_n)->ele,(_ele)) <= 0))
+#ifdef ZSET_PREFETCH
+/* Prefetch the nodes that a search standing on 'x' at level 'i' can visit
+ * after the next node of the level, before that node is compared: the node
+ * that follows it on the level, and the next node of the level below. The
+ * cache misses of the next step then overlap with the current one. */
+static inline void zslPrefetch(zskiplistNode *x, int i) {
+    zskiplistNode *next = x->level[i].forward;
 
-/* Insert a new node in the skiplist. Assumes the element does not already
- * exist (up to the caller to enforce that). The skiplist takes ownership
- * of the passed SDS string 'ele'. */
-zskiplistNode *zslInsert(zskiplist *zsl, double score, long long timestamp, sds ele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned int rank[ZSKIPLIST_MAXLEVEL];
-    int i, level;
+    if (next) __builtin_prefetch(next->level[i].forward);
+    if (i > 0) __builtin_prefetch(x->level[i-1].forward);
+}
+#else
+#define zslPrefetch(x,i)
+#endif
+
+/* '_key' is zslMakeKey() of the score and timestamp of the element, and
+ * '_ord' the order key of its member '_ele', see zslMemberOrder(). */
+#define COMPARE_NODE_LT(_zsl, _n, _key, _ele, _ord) \
+    zslNodeBefore(_zsl,_n,_key,_ele,_ord,0)
+#define COMPARE_NODE_LTE(_zsl, _n, _key, _ele, _ord) \
+    zslNodeBefore(_zsl,_n,_key,_ele,_ord,1)
+
+/* Adjust the cached cursors (see zslCursor) for the node 'x', that was just
+ * linked when 'delta' is 1, or is about to be unlinked when it is -1: the
+ * cursors on nodes sorting after it move by one rank, and a cursor on 'x'
+ * itself is dropped. This costs a few key comparisons per write when
+ * cursors are set, against a search by rank saved by every page served
+ * from a cursor (tools/bench_cursors.c measures both). */
+static void zslCursorsUpdate(zskiplist *zsl, zskiplistNode *x, int delta) {
+    uint64_t order;
+    zslKey key;
+    int j;
 
-    serverAssert(!isnan(score));
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        /* store rank that is crossed to reach the insert position */
-        rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
-        while (x->level[i].forward &&
-                COMPARE_NODE_LT(x->level[i].forward,score,timestamp,ele))
-        {
-            rank[i] += x->level[i].span;
-            x = x->level[i].forward;
+    for (j = 0; j < ZSL_CURSORS; j++)
+        if (zsl->cursor[j].node) break;
+    if (j == ZSL_CURSORS) return;
+
+    key = zslNodeKey(zsl,x);
+    order = zslMemberOrder(zsl->intmembers,x->ele);
+    for (; j < ZSL_CURSORS; j++) {
+        zslCursor *c = &zsl->cursor[j];
+
+        if (c->node == NULL) continue;
+        if (c->node == x) {
+            c->node = NULL;
+        } else if (!COMPARE_NODE_LT(zsl,c->node,key,x->ele,order)) {
+            c->rank += delta;
+        }
+    }
+}
+
+/* Drop all the cached cursors. Writes touching many nodes call it once
+ * before starting, so that zslCursorsUpdate() returns at once for every node
+ * instead of comparing it with each cursor. Single element writes keep the
+ * cursors, see zslCursorsUpdate(). */
+void zslCursorsReset(zskiplist *zsl) {
+    int j;
+
+    for (j = 0; j < ZSL_CURSORS; j++) zsl->cursor[j].node = NULL;
+}
+
+/* Link 'x' at level 0 of a B+tree backed skiplist, right after 'prev'
+ * (NULL to link it as first element). */
+static void zslBtreeLink(zskiplist *zsl, zskiplistNode *prev, zskiplistNode *x) {
+    zskiplistNode *update = prev ? prev : zsl->header;
+
+    x->level[0].forward = update->level[0].forward;
+    zslSetSpan(x,0,1);
+    update->level[0].forward = x;
+    x->backward = prev;
+    if (x->level[0].forward)
+        x->level[0].forward->backward = x;
+    else
+        zsl->tail = x;
+    zsl->length++;
+    zslCursorsUpdate(zsl,x,1);
+}
+
+/* Insert the node 'x' holding the element with the given score and
+ * timestamp in the B+tree and at level 0. Like in zslLinkNode(), elements
+ * sorting after the tail or before the first element skip the search. */
+static void zslBtreeInsert(zskiplist *zsl, zskiplistNode *x, double score, long long timestamp) {
+    zskiplistNode *first = zsl->header->level[0].forward, *prev;
+    uint64_t order = zslMemberOrder(zsl->intmembers,x->ele);
+    zslKey key = zslMakeKey(score,timestamp);
+
+    if (zsl->tail && COMPARE_NODE_LT(zsl,zsl->tail,key,x->ele,order))
+        prev = zbtInsertEdge(zsl->zbt,x,score,timestamp,1);
+    else if (first && !COMPARE_NODE_LTE(zsl,first,key,x->ele,order))
+        prev = zbtInsertEdge(zsl->zbt,x,score,timestamp,0);
+    else
+        prev = zbtInsert(zsl->zbt,x,score,timestamp,NULL);
+    zslBtreeLink(zsl,prev,x);
+}
+
+/* Unlink 'x' from level 0 of a B+tree backed skiplist. */
+static void zslBtreeUnlink(zskiplist *zsl, zskiplistNode *x) {
+    zskiplistNode *update = x->backward ? x->backward : zsl->header;
+
+    zslCursorsUpdate(zsl,x,-1);
+    update->level[0].forward = x->level[0].forward;
+    if (x->level[0].forward)
+        x->level[0].forward->backward = x->backward;
+    else
+        zsl->tail = x->backward;
+    zsl->length--;
+}
+
+/* Link the node 'x', that has 'level' levels and holds the element with
+ * the given score and timestamp, at its position in the skiplist. When
+ * 'finger' is not NULL the search resumes from the position it holds, if
+ * any, which must sort before 'x', and is then set to the position of 'x'. */
+static void zslLinkNode(zskiplist *zsl, zskiplistNode *x, int level, double score, long long timestamp, zslFinger *finger) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *y;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL];
+    uint64_t order = zslMemberOrder(zsl->intmembers,x->ele);
+    zslKey key = zslMakeKey(score,timestamp);
+    int i;
+
+    y = zsl->header->level[0].forward;
+    if (zsl->tail && COMPARE_NODE_LT(zsl,zsl->tail,key,x->ele,order)) {
+        /* Append: the node goes after the rightmost node of every level.
+         * The rank of a node without successor is the length minus its
+         * span, as such spans count the nodes after it. */
+        for (i = 0; i < zsl->level; i++) {
+            update[i] = zsl->rightmost[i];
+            rank[i] = update[i] == zsl->header ? 0 : zsl->length-zslSpan(update[i],i);
+        }
+    } else if (y && !COMPARE_NODE_LTE(zsl,y,key,x->ele,order)) {
+        /* Prepend: the node goes right after the header at every level. */
+        for (i = 0; i < zsl->level; i++) {
+            update[i] = zsl->header;
+            rank[i] = 0;
+        }
+    } else {
+        y = zsl->header;
+        for (i = zsl->level-1; i >= 0; i--) {
+            /* store rank that is crossed to reach the insert position */
+            rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
+            /* Both the finger and 'y' sort before 'x': start from the
+             * one that is further on this level. */
+            if (finger && finger->zsl == zsl && finger->rank[i] > rank[i]) {
+                y = finger->node[i];
+                rank[i] = finger->rank[i];
+            }
+            zslPrefetch(y,i);
+            while (y->level[i].forward &&
+                    COMPARE_NODE_LT(zsl,y->level[i].forward,key,x->ele,order))
+            {
+                rank[i] += zslSpan(y,i);
+                y = y->level[i].forward;
+                zslPrefetch(y,i);
+            }
+            update[i] = y;
         }
-        update[i] = x;
     }
-    /* we assume the element is not already inside, since we allow duplicated
-     * scores, reinserting the same element should never happen since the
-     * caller of zslInsert() should test in the hash table if the element is
-     * already inside or not. */
-    level = zslRandomLevel();
     if (level > zsl->level) {
         for (i = zsl->level; i < level; i++) {
             rank[i] = 0;
             update[i] = zsl->header;
-            update[i]->level[i].span = zsl->length;
+            zslSetSpan(update[i],i,zsl->length);
         }
         zsl->level = level;
     }
-    x = zslCreateNode(level,score,ele,timestamp);
     for (i = 0; i < level; i++) {
         x->level[i].forward = update[i]->level[i].forward;
         update[i]->level[i].forward = x;
 
         /* update span covered by update[i] as x is inserted here */
-        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
-        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+        zslSetSpan(x,i,zslSpan(update[i],i) - (rank[0] - rank[i]));
+        zslSetSpan(update[i],i,(rank[0] - rank[i]) + 1);
+        if (x->level[i].forward == NULL) zsl->rightmost[i] = x;
     }
 
     /* increment span for untouched levels */
     for (i = level; i < zsl->level; i++) {
-        update[i]->level[i].span++;
+        zslSetSpan(update[i],i,zslSpan(update[i],i)+1);
     }
 
     x->backward = (update[0] == zsl->header) ? NULL : update[0];
@@ -255,18 +1051,60 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, long long timestamp, sds
     else
         zsl->tail = x;
     zsl->length++;
+    zslCursorsUpdate(zsl,x,1);
+
+    if (finger) {
+        finger->zsl = zsl;
+        for (i = 0; i < zsl->level; i++) {
+            finger->node[i] = i < level ? x : update[i];
+            finger->rank[i] = i < level ? rank[0]+1 : rank[i];
+        }
+    }
+}
+
+/* Insert a new node in the skiplist. Assumes the element does not already
+ * exist (up to the caller to enforce that). The member is copied into the
+ * new node, so the caller retains the ownership of the SDS string 'ele'.
+ * With a 'finger' (see zslFinger) the search starts from the previous
+ * insertion, so it must be called with ascending elements. The B+tree
+ * engine doesn't use fingers. */
+static zskiplistNode *zslInsertFrom(zskiplist *zsl, zslFinger *finger, double score, long long timestamp, sds ele) {
+    zskiplistNode *x;
+    int level;
+
+    serverAssert(!isnan(score));
+    if (zsl->zbt) {
+        x = zslCreateNode(zsl,1,score,ele,timestamp);
+        zslBtreeInsert(zsl,x,score,timestamp);
+        return x;
+    }
+
+    /* we assume the element is not already inside, since we allow duplicated
+     * scores, reinserting the same element should never happen since the
+     * caller of zslInsert() should test in the hash table if the element is
+     * already inside or not. */
+    level = zslRandomLevel();
+    x = zslCreateNode(zsl,level,score,ele,timestamp);
+    zslLinkNode(zsl,x,level,score,timestamp,finger);
     return x;
 }
 
+zskiplistNode *zslInsert(zskiplist *zsl, double score, long long timestamp, sds ele) {
+    return zslInsertFrom(zsl,NULL,score,timestamp,ele);
+}
+
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
 void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     int i;
+
+    zslCursorsUpdate(zsl,x,-1);
     for (i = 0; i < zsl->level; i++) {
         if (update[i]->level[i].forward == x) {
-            update[i]->level[i].span += x->level[i].span - 1;
+            zslSetSpan(update[i],i,zslSpan(update[i],i)+zslSpan(x,i)-1);
             update[i]->level[i].forward = x->level[i].forward;
+            if (zsl->rightmost[i] == x) zsl->rightmost[i] = update[i];
         } else {
-            update[i]->level[i].span -= 1;
+            zslSetSpan(update[i],i,zslSpan(update[i],i)-1);
         }
     }
     if (x->level[0].forward) {
@@ -286,27 +1124,44 @@ void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
  * If 'node' is NULL the deleted node is freed by zslFreeNode(), otherwise
  * it is not freed (but just unlinked) and *node is set to the node pointer,
  * so that it is possible for the caller to reuse the node (including the
- * referenced SDS string at node->ele). */
+ * member embedded at node->ele). */
 int zslDelete(zskiplist *zsl, double score, long long timestamp, sds ele, zskiplistNode **node) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    uint64_t order;
+    zslKey key;
     int i;
 
+    if (zsl->zbt) {
+        x = zbtDelete(zsl->zbt,score,timestamp,ele);
+        if (x == NULL) return 0;
+        zslBtreeUnlink(zsl,x);
+        if (!node)
+            zslFreeNode(zsl,x);
+        else
+            *node = x;
+        return 1;
+    }
+
+    order = zslMemberOrder(zsl->intmembers,ele);
+    key = zslMakeKey(score,timestamp);
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
+        zslPrefetch(x,i);
         while (x->level[i].forward &&
-                COMPARE_NODE_LT(x->level[i].forward,score,timestamp,ele))
+                COMPARE_NODE_LT(zsl,x->level[i].forward,key,ele,order))
         {
             x = x->level[i].forward;
+            zslPrefetch(x,i);
         }
         update[i] = x;
     }
     /* We may have multiple elements with the same score, what we need
      * is to find the element with both the right score and object. */
     x = x->level[0].forward;
-    if (x && score == x->score && sdscmp(x->ele,ele) == 0) {
+    if (x && score == x->score && zslCompareMember(x,ele,order) == 0) {
         zslDeleteNode(zsl, x, update);
         if (!node)
-            zslFreeNode(x);
+            zslFreeNode(zsl,x);
         else
             *node = x;
         return 1;
@@ -314,12 +1169,103 @@ int zslDelete(zskiplist *zsl, double score, long long timestamp, sds ele, zskipl
     return 0; /* not found */
 }
 
-int zslValueGteMin(double value, zrangespec *spec) {
-    return spec->minex ? (value > spec->min) : (value >= spec->min);
+/* Store 'timestamp' in the node 'x' of the skiplist, which already has a
+ * timestamp. Returns 0 if this is not possible without reallocating the
+ * node: with ZSET_COMPACT_TS the node has room for the full timestamp only
+ * if it was created with one. */
+static int zslSetNodeTimestamp(zskiplist *zsl, zskiplistNode *x, long long timestamp) {
+#ifdef ZSET_COMPACT_TS
+    uint32_t tsoffset;
+
+    if (x->level[0].tsoffset == ZSL_TS_ESCAPE) {
+        memcpy((char*)x-sizeof(timestamp),&timestamp,sizeof(timestamp));
+        return 1;
+    }
+    if (zslNodeTimestamp(zsl,x) == timestamp) return 1;
+    if ((tsoffset = zslTimestampOffset(zsl,timestamp)) == ZSL_TS_ESCAPE) return 0;
+    x->level[0].tsoffset = tsoffset;
+#else
+    DICT_NOTUSED(zsl);
+    x->timestamp = timestamp;
+#endif
+    return 1;
 }
 
-int zslValueLteMax(double value, zrangespec *spec) {
-    return spec->maxex ? (value < spec->max) : (value <= spec->max);
+/* Update the score and the timestamp of the node 'x' of the skiplist, which
+ * holds an element with the score 'curscore' and the timestamp 'curts'.
+ * When the new key still sorts between the neighbours of the node, the node
+ * is updated in place without searching the skiplist. Otherwise it is
+ * unlinked and linked again at its new position, keeping its levels.
+ *
+ * The node is reused unless, with ZSET_COMPACT_TS, it has no room for the
+ * new timestamp: a new node is inserted then, and it is up to the caller to
+ * free 'x' once the references to it are updated. The function returns the
+ * node holding the element. */
+zskiplistNode *zslUpdateScore(zskiplist *zsl, zskiplistNode *x, double curscore,
+                              long long curts, double newscore, long long newts)
+{
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *prev = x->backward, *next = x->level[0].forward, *y;
+    uint64_t order = zslMemberOrder(zsl->intmembers,x->ele);
+    zslKey curkey = zslMakeKey(curscore,curts), newkey = zslMakeKey(newscore,newts);
+    int i, level;
+
+    serverAssert(!isnan(newscore));
+
+    /* If the node would stay in the same position, update it in place. */
+    if ((prev == NULL || COMPARE_NODE_LT(zsl,prev,newkey,x->ele,order)) &&
+        (next == NULL || !COMPARE_NODE_LTE(zsl,next,newkey,x->ele,order)) &&
+        zslSetNodeTimestamp(zsl,x,newts))
+    {
+        if (zsl->zbt) serverAssert(zbtUpdateKey(zsl->zbt,curscore,curts,x->ele,newscore,newts) == x);
+        x->score = newscore;
+        return x;
+    }
+
+    /* Unlink the node, finding out how many levels it has. */
+    if (zsl->zbt) {
+        serverAssert(zbtDelete(zsl->zbt,curscore,curts,x->ele) == x);
+        zslBtreeUnlink(zsl,x);
+        level = 1;
+    } else {
+        y = zsl->header;
+        for (i = zsl->level-1; i >= 0; i--) {
+            zslPrefetch(y,i);
+            while (y->level[i].forward &&
+                    COMPARE_NODE_LT(zsl,y->level[i].forward,curkey,x->ele,order))
+            {
+                y = y->level[i].forward;
+                zslPrefetch(y,i);
+            }
+            update[i] = y;
+        }
+        serverAssert(update[0]->level[0].forward == x);
+        for (level = 1; level < zsl->level; level++)
+            if (update[level]->level[level].forward != x) break;
+        zslDeleteNode(zsl,x,update);
+    }
+
+    if (!zslSetNodeTimestamp(zsl,x,newts))
+        return zslInsert(zsl,newscore,newts,x->ele);
+    x->score = newscore;
+    if (zsl->zbt)
+        zslBtreeInsert(zsl,x,newscore,newts);
+    else
+        zslLinkNode(zsl,x,level,newscore,newts,NULL);
+    return x;
+}
+
+int zslKeyGteMin(zslKey key, zrangespec *spec) {
+    return spec->minex ? zslKeyLess(spec->min,key) : !zslKeyLess(key,spec->min);
+}
+
+int zslKeyLteMax(zslKey key, zrangespec *spec) {
+    return spec->maxex ? zslKeyLess(key,spec->max) : !zslKeyLess(spec->max,key);
+}
+
+/* Returns true if the range 'spec' can't contain any element. */
+static int zslIsEmptyRange(zrangespec *spec) {
+    return zslKeyLess(spec->max,spec->min) ||
+           (zslKeyEqual(spec->min,spec->max) && (spec->minex || spec->maxex));
 }
 
 /* Returns if there is a part of the zset is in range. */
@@ -327,33 +1273,64 @@ int zslIsInRange(zskiplist *zsl, zrangespec *range) {
     zskiplistNode *x;
 
     /* Test for ranges that will always be empty. */
-    if (range->min > range->max ||
-            (range->min == range->max && (range->minex || range->maxex)))
-        return 0;
+    if (zslIsEmptyRange(range)) return 0;
     x = zsl->tail;
-    if (x == NULL || !zslValueGteMin(x->score,range))
+    if (x == NULL || !zslKeyGteMin(zslNodeKey(zsl,x),range))
         return 0;
     x = zsl->header->level[0].forward;
-    if (x == NULL || !zslValueLteMax(x->score,range))
+    if (x == NULL || !zslKeyLteMax(zslNodeKey(zsl,x),range))
         return 0;
     return 1;
 }
 
+/* zbtLastMatching() predicates used to search ranges in the B+tree. */
+static int zslBtreeBeforeMin(double score, long long timestamp, zskiplistNode *ele, void *privdata) {
+    DICT_NOTUSED(ele);
+    return !zslKeyGteMin(zslMakeKey(score,timestamp),privdata);
+}
+
+static int zslBtreeLteMax(double score, long long timestamp, zskiplistNode *ele, void *privdata) {
+    DICT_NOTUSED(ele);
+    return zslKeyLteMax(zslMakeKey(score,timestamp),privdata);
+}
+
+/* First element of a B+tree backed skiplist with score >= min, or NULL.
+ * Its 1-based rank is stored in '*rank' when not NULL. */
+static zskiplistNode *zslBtreeFirstGteMin(zskiplist *zsl, zrangespec *range, unsigned long *rank) {
+    zskiplistNode *x = zbtLastMatching(zsl->zbt,zslBtreeBeforeMin,range,rank);
+    if (rank) (*rank)++;
+    return x ? x->level[0].forward : zsl->header->level[0].forward;
+}
+
 /* Find the first node that is contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range) {
+ * Returns NULL when no element is contained in the range. Otherwise when
+ * 'rank' is not NULL the 1-based rank of the node is stored there, as
+ * counted by the spans crossed during the search. */
+zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range, unsigned long *rank) {
     zskiplistNode *x;
+    unsigned long traversed = 0;
     int i;
 
     /* If everything is out of range, return early. */
     if (!zslIsInRange(zsl,range)) return NULL;
 
+    if (zsl->zbt) {
+        x = zslBtreeFirstGteMin(zsl,range,rank);
+        serverAssert(x != NULL);
+        return zslKeyLteMax(zslNodeKey(zsl,x),range) ? x : NULL;
+    }
+
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
         /* Go forward while *OUT* of range. */
+        zslPrefetch(x,i);
         while (x->level[i].forward &&
-            !zslValueGteMin(x->level[i].forward->score,range))
-                x = x->level[i].forward;
+            !zslKeyGteMin(zslNodeKey(zsl,x->level[i].forward),range))
+        {
+            traversed += zslSpan(x,i);
+            x = x->level[i].forward;
+            zslPrefetch(x,i);
+        }
     }
 
     /* This is an inner range, so the next node cannot be NULL. */
@@ -361,49 +1338,130 @@ zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range) {
     serverAssert(x != NULL);
 
     /* Check if score <= max. */
-    if (!zslValueLteMax(x->score,range)) return NULL;
+    if (!zslKeyLteMax(zslNodeKey(zsl,x),range)) return NULL;
+    if (rank) *rank = traversed+1;
     return x;
 }
 
 /* Find the last node that is contained in the specified range.
- * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
+ * Returns NULL when no element is contained in the range. Otherwise when
+ * 'rank' is not NULL the 1-based rank of the node is stored there. */
+zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range, unsigned long *rank) {
     zskiplistNode *x;
+    unsigned long traversed = 0;
     int i;
 
     /* If everything is out of range, return early. */
     if (!zslIsInRange(zsl,range)) return NULL;
 
+    if (zsl->zbt) {
+        x = zbtLastMatching(zsl->zbt,zslBtreeLteMax,range,rank);
+        serverAssert(x != NULL);
+        return zslKeyGteMin(zslNodeKey(zsl,x),range) ? x : NULL;
+    }
+
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
         /* Go forward while *IN* range. */
+        zslPrefetch(x,i);
         while (x->level[i].forward &&
-            zslValueLteMax(x->level[i].forward->score,range))
-                x = x->level[i].forward;
+            zslKeyLteMax(zslNodeKey(zsl,x->level[i].forward),range))
+        {
+            traversed += zslSpan(x,i);
+            x = x->level[i].forward;
+            zslPrefetch(x,i);
+        }
     }
 
     /* This is an inner range, so this node cannot be NULL. */
     serverAssert(x != NULL);
 
     /* Check if score >= min. */
-    if (!zslValueGteMin(x->score,range)) return NULL;
+    if (!zslKeyGteMin(zslNodeKey(zsl,x),range)) return NULL;
+    if (rank) *rank = traversed;
     return x;
 }
 
+/* Element the searches of zslNextToElement() compare with. */
+typedef struct zslAnchor {
+    double score;
+    long long timestamp;
+    sds ele;
+    uint64_t order;
+    int orequal;
+} zslAnchor;
+
+/* zbtLastMatching() predicate: the element sorts before the anchor, or is
+ * the anchor when 'orequal' is set. */
+static int zslBtreeBeforeAnchor(double score, long long timestamp, zskiplistNode *ele, void *privdata) {
+    zslAnchor *anchor = privdata;
+    int cmp;
+
+    if (score != anchor->score) return score < anchor->score;
+    if (timestamp != anchor->timestamp) return timestamp > anchor->timestamp;
+    cmp = zslCompareMember(ele,anchor->ele,anchor->order);
+    return anchor->orequal ? cmp <= 0 : cmp < 0;
+}
+
+/* Return the first node that sorts after the element with the given score,
+ * timestamp and member, or the last node that sorts before it if 'reverse'
+ * is true. Returns NULL if there is no such node. The element doesn't need
+ * to be in the skiplist. */
+zskiplistNode *zslNextToElement(zskiplist *zsl, double score, long long timestamp, sds ele, int reverse) {
+    zskiplistNode *x;
+    zslAnchor anchor = {score,timestamp,ele,zslMemberOrder(zsl->intmembers,ele),!reverse};
+    zslKey key = zslMakeKey(score,timestamp);
+    int i;
+
+    /* Find the last node before the element, or before or equal to it
+     * going forward, so that the first node after it is the next one. */
+    if (zsl->zbt) {
+        x = zbtLastMatching(zsl->zbt,zslBtreeBeforeAnchor,&anchor,NULL);
+        if (x == NULL) x = zsl->header;
+    } else {
+        x = zsl->header;
+        for (i = zsl->level-1; i >= 0; i--) {
+            zslPrefetch(x,i);
+            while (x->level[i].forward &&
+                   zslNodeBefore(zsl,x->level[i].forward,key,ele,anchor.order,anchor.orequal))
+            {
+                x = x->level[i].forward;
+                zslPrefetch(x,i);
+            }
+        }
+    }
+    if (reverse) return x == zsl->header ? NULL : x;
+    return x->level[0].forward;
+}
+
 /* Delete all the elements with score between min and max from the skiplist.
  * Min and max are inclusive, so a score >= min || score <= max is deleted.
  * Note that this function takes the reference to the hash table view of the
  * sorted set, in order to remove the elements from the hash table too. */
-unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dict) {
+unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, zsetDict *dict) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
     unsigned long removed = 0;
     int i;
 
+    zslCursorsReset(zsl);
+    if (zsl->zbt) {
+        x = zslBtreeFirstGteMin(zsl,range,NULL);
+        while (x && zslKeyLteMax(zslNodeKey(zsl,x),range)) {
+            zskiplistNode *next = x->level[0].forward;
+            zbtDelete(zsl->zbt,x->score,zslNodeTimestamp(zsl,x),x->ele);
+            zslBtreeUnlink(zsl,x);
+            zsetDictDelete(dict,x->ele);
+            zslFreeNode(zsl,x);
+            removed++;
+            x = next;
+        }
+        return removed;
+    }
+
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (range->minex ?
-            x->level[i].forward->score <= range->min :
-            x->level[i].forward->score < range->min))
+        while (x->level[i].forward &&
+               !zslKeyGteMin(zslNodeKey(zsl,x->level[i].forward),range))
                 x = x->level[i].forward;
         update[i] = x;
     }
@@ -412,13 +1470,11 @@ unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dic
     x = x->level[0].forward;
 
     /* Delete nodes while in range. */
-    while (x &&
-           (range->maxex ? x->score < range->max : x->score <= range->max))
-    {
+    while (x && zslKeyLteMax(zslNodeKey(zsl,x),range)) {
         zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
+        zsetDictDelete(dict,x->ele);
+        zslFreeNode(zsl,x); /* Here is where x->ele is actually released. */
         removed++;
         x = next;
     }
@@ -427,15 +1483,30 @@ unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dic
 
 /* Delete all the elements with rank between start and end from the skiplist.
  * Start and end are inclusive. Note that start and end need to be 1-based */
-unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned int end, dict *dict) {
+unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned long start, unsigned long end, zsetDict *dict) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
     unsigned long traversed = 0, removed = 0;
     int i;
 
+    zslCursorsReset(zsl);
+    if (zsl->zbt) {
+        x = zbtGetElementByRank(zsl->zbt,start);
+        while (x && removed <= end-start) {
+            zskiplistNode *next = x->level[0].forward;
+            zbtDelete(zsl->zbt,x->score,zslNodeTimestamp(zsl,x),x->ele);
+            zslBtreeUnlink(zsl,x);
+            zsetDictDelete(dict,x->ele);
+            zslFreeNode(zsl,x);
+            removed++;
+            x = next;
+        }
+        return removed;
+    }
+
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) < start) {
-            traversed += x->level[i].span;
+        while (x->level[i].forward && (traversed + zslSpan(x,i)) < start) {
+            traversed += zslSpan(x,i);
             x = x->level[i].forward;
         }
         update[i] = x;
@@ -446,8 +1517,8 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
     while (x && traversed <= end) {
         zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x);
+        zsetDictDelete(dict,x->ele);
+        zslFreeNode(zsl,x);
         removed++;
         traversed++;
         x = next;
@@ -455,114 +1526,689 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
     return removed;
 }
 
-/* Find the rank for an element by both score and key.
- * Returns 0 when the element cannot be found, rank otherwise.
- * Note that the rank is 1-based due to the span of zsl->header to the
- * first element. */
-unsigned long zslGetRank(zskiplist *zsl, double score, long long timestamp, sds ele) {
-    zskiplistNode *x;
-    unsigned long rank = 0;
-    int i;
+/* Find the rank for an element by both score and key.
+ * Returns 0 when the element cannot be found, rank otherwise.
+ * Note that the rank is 1-based due to the span of zsl->header to the
+ * first element. */
+unsigned long zslGetRank(zskiplist *zsl, double score, long long timestamp, sds ele) {
+    zskiplistNode *x;
+    unsigned long rank = 0;
+    uint64_t order;
+    zslKey key;
+    int i;
+
+    if (zsl->zbt) return zbtGetRank(zsl->zbt,score,timestamp,ele);
+
+    order = zslMemberOrder(zsl->intmembers,ele);
+    key = zslMakeKey(score,timestamp);
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        zslPrefetch(x,i);
+        while (x->level[i].forward &&
+                COMPARE_NODE_LTE(zsl,x->level[i].forward,key,ele,order)) {
+            rank += zslSpan(x,i);
+            x = x->level[i].forward;
+            zslPrefetch(x,i);
+        }
+
+        /* x might be equal to zsl->header, so test if obj is non-NULL */
+        if (x->ele && zslCompareMember(x,ele,order) == 0) {
+            return rank;
+        }
+    }
+    return 0;
+}
+
+/* Finds an element by its rank. The rank argument needs to be 1-based. */
+zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
+    zskiplistNode *x;
+    unsigned long traversed = 0;
+    int i;
+
+    if (zsl->zbt) return zbtGetElementByRank(zsl->zbt,rank);
+
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        while (x->level[i].forward && (traversed + zslSpan(x,i)) <= rank)
+        {
+            traversed += zslSpan(x,i);
+            x = x->level[i].forward;
+        }
+        if (traversed == rank) {
+            return x;
+        }
+    }
+    return NULL;
+}
+
+/* Like zslGetElementByRank(), but first try the cached cursors: a cursor on
+ * the node of rank 'rank' or on one of its neighbours saves the search.
+ * '*slot' is set to the cursor that was used, or to -1, to update it with
+ * zslCursorSet() once the reply is done. The rank must be in range. */
+zskiplistNode *zslCursorGetElementByRank(zskiplist *zsl, unsigned long rank, int *slot) {
+    zskiplistNode *x;
+    int j;
+
+    for (j = 0; j < ZSL_CURSORS; j++) {
+        zslCursor *c = &zsl->cursor[j];
+
+        if ((x = c->node) == NULL) continue;
+        if (c->rank+1 == rank)
+            x = x->level[0].forward;
+        else if (c->rank == rank+1)
+            x = x->backward;
+        else if (c->rank != rank)
+            continue;
+        zsl->cursor_hits++;
+        *slot = j;
+        return x;
+    }
+    zsl->cursor_misses++;
+    *slot = -1;
+    return zslGetElementByRank(zsl,rank);
+}
+
+/* Remember that 'x' has rank 'rank', in the cursor 'slot' as returned by
+ * zslCursorGetElementByRank(). With a slot of -1 the cursor already on 'x'
+ * is used if any, otherwise the cursors are replaced round robin. */
+void zslCursorSet(zskiplist *zsl, int slot, zskiplistNode *x, unsigned long rank) {
+    int j;
+
+    for (j = 0; slot == -1 && j < ZSL_CURSORS; j++)
+        if (zsl->cursor[j].node == x) slot = j;
+    if (slot == -1) {
+        slot = zsl->nextcursor;
+        zsl->nextcursor = (zsl->nextcursor+1) % ZSL_CURSORS;
+    }
+    zsl->cursor[slot].node = x;
+    zsl->cursor[slot].rank = rank;
+}
+
+/* Parse a bound of a range: a score, optionally followed by ':' and a
+ * timestamp, and prefixed by '(' when exclusive. The key of the bound is
+ * stored in '*key'. A score alone includes or excludes all the elements
+ * with that score, so it gets the timestamp that sorts first or last among
+ * them, as fits the side of the bound. 'ismax' tells the side. */
+static int zslParseBound(RedisModuleString *bound, int ismax, zslKey *key, int *ex) {
+    size_t l;
+    const char *c = RedisModule_StringPtrLen(bound, &l);
+    char *eptr;
+    double score;
+    long long timestamp;
+
+    *ex = c[0] == '(';
+    if (*ex) c++;
+    score = strtod(c,&eptr);
+    if (isnan(score)) return C_ERR;
+    if (eptr[0] == ':' && eptr != c) {
+        c = eptr+1;
+        errno = 0;
+        timestamp = strtoll(c,&eptr,10);
+        if (eptr == c || errno == ERANGE) return C_ERR;
+    } else {
+        timestamp = (ismax == *ex) ? LLONG_MAX : LLONG_MIN;
+    }
+    if (eptr[0] != '\0') return C_ERR;
+    *key = zslMakeKey(score,timestamp);
+    return REDISMODULE_OK;
+}
+
+/* Populate the rangespec according to the objects min and max. */
+static int zslParseRange(RedisModuleString *min, RedisModuleString *max, zrangespec *spec) {
+    /* Parse the min-max interval. If one of the values is prefixed
+     * by the "(" character, it's considered "open". For instance
+     * ZRANGEBYSCORE zset (1.5 (2.5 will match min < x < max
+     * ZRANGEBYSCORE zset 1.5 2.5 will instead match min <= x <= max
+     * A bound can also be given as score:timestamp, and is then compared
+     * with the score and the timestamp of the elements, in the order of
+     * the set: ZRANGEBYSCORE zset 1:200 1:100 matches the elements with
+     * score 1 and timestamp between 100 and 200. */
+    if (zslParseBound(min,0,&spec->min,&spec->minex) != REDISMODULE_OK ||
+        zslParseBound(max,1,&spec->max,&spec->maxex) != REDISMODULE_OK)
+        return C_ERR;
+    return REDISMODULE_OK;
+}
+
+/*-----------------------------------------------------------------------------
+ * Packed encoding low level API
+ *----------------------------------------------------------------------------*/
+
+/* Compare the entry at 'p' with the element score/timestamp/ele using the
+ * same ordering of the skiplist. Returns a negative value if the entry sorts
+ * before the element, zero if they are the same, positive otherwise. */
+static int zzlCompare(unsigned char *p, double score, long long timestamp, sds ele) {
+    unsigned char *pele;
+    size_t plen, minlen;
+    double pscore;
+    long long ptimestamp;
+    int cmp;
+
+    zpkGet(p,&pele,&plen,&pscore,&ptimestamp);
+    if (pscore != score) return pscore < score ? -1 : 1;
+    if (ptimestamp != timestamp) return ptimestamp > timestamp ? -1 : 1;
+    minlen = (plen < sdslen(ele)) ? plen : sdslen(ele);
+    cmp = memcmp(pele,ele,minlen);
+    if (cmp == 0) return (plen < sdslen(ele)) ? -1 : (plen > sdslen(ele));
+    return cmp;
+}
+
+/* Ordering key of the entry at 'p', see zslMakeKey(). */
+static zslKey zzlGetKey(unsigned char *p) {
+    double score;
+    long long timestamp;
+    zpkGet(p,NULL,NULL,&score,&timestamp);
+    return zslMakeKey(score,timestamp);
+}
+
+/* Insert (element,score,timestamp) in the right position of the packed
+ * list. Assumes the element is not already inside. */
+unsigned char *zzlInsert(unsigned char *zp, sds ele, double score, long long timestamp) {
+    unsigned char *p = zpkFirst(zp);
+
+    while (p != NULL && zzlCompare(p,score,timestamp,ele) < 0)
+        p = zpkNext(zp,p);
+    return zpkInsert(zp,p,(unsigned char*)ele,sdslen(ele),score,timestamp);
+}
+
+/* Find the entry of 'ele', populating score and timestamp if not NULL.
+ * Returns NULL when the element is not found. */
+unsigned char *zzlFind(unsigned char *zp, sds ele, double *score, long long *timestamp) {
+    unsigned char *p = zpkFirst(zp);
+
+    while (p != NULL) {
+        if (zpkEqualMember(p,(unsigned char*)ele,sdslen(ele))) {
+            zpkGet(p,NULL,NULL,score,timestamp);
+            return p;
+        }
+        p = zpkNext(zp,p);
+    }
+    return NULL;
+}
+
+/* Return the first entry that sorts after the element score/timestamp/ele,
+ * or the last entry that sorts before it if 'reverse' is true, or NULL if
+ * there is none. The element doesn't need to be in the packed list. */
+unsigned char *zzlNextToElement(unsigned char *zp, double score, long long timestamp, sds ele, int reverse) {
+    unsigned char *p;
+
+    if (reverse) {
+        p = zpkLast(zp);
+        while (p != NULL && zzlCompare(p,score,timestamp,ele) >= 0)
+            p = zpkPrev(zp,p);
+    } else {
+        p = zpkFirst(zp);
+        while (p != NULL && zzlCompare(p,score,timestamp,ele) <= 0)
+            p = zpkNext(zp,p);
+    }
+    return p;
+}
+
+/* Returns if there is a part of the packed list in range. */
+int zzlIsInRange(unsigned char *zp, zrangespec *range) {
+    unsigned char *p;
+
+    /* Test for ranges that will always be empty. */
+    if (zslIsEmptyRange(range)) return 0;
+
+    p = zpkLast(zp);
+    if (p == NULL || !zslKeyGteMin(zzlGetKey(p),range))
+        return 0;
+    p = zpkFirst(zp);
+    if (!zslKeyLteMax(zzlGetKey(p),range))
+        return 0;
+    return 1;
+}
+
+/* Find pointer to the first element contained in the specified range.
+ * Returns NULL when no element is contained in the range. */
+unsigned char *zzlFirstInRange(unsigned char *zp, zrangespec *range) {
+    unsigned char *p;
+    zslKey key;
+
+    /* If everything is out of range, return early. */
+    if (!zzlIsInRange(zp,range)) return NULL;
+
+    for (p = zpkFirst(zp); p != NULL; p = zpkNext(zp,p)) {
+        key = zzlGetKey(p);
+        if (zslKeyGteMin(key,range)) {
+            /* Check if score <= max. */
+            if (zslKeyLteMax(key,range)) return p;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Find pointer to the last element contained in the specified range.
+ * Returns NULL when no element is contained in the range. */
+unsigned char *zzlLastInRange(unsigned char *zp, zrangespec *range) {
+    unsigned char *p;
+    zslKey key;
+
+    /* If everything is out of range, return early. */
+    if (!zzlIsInRange(zp,range)) return NULL;
+
+    for (p = zpkLast(zp); p != NULL; p = zpkPrev(zp,p)) {
+        key = zzlGetKey(p);
+        if (zslKeyLteMax(key,range)) {
+            /* Check if score >= min. */
+            if (zslKeyGteMin(key,range)) return p;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Delete all the elements with score in range. The number of deleted
+ * elements is stored into 'deleted' if not NULL. */
+unsigned char *zzlDeleteRangeByScore(unsigned char *zp, zrangespec *range, unsigned long *deleted) {
+    unsigned char *p;
+    unsigned long num = 0;
+
+    if (deleted != NULL) *deleted = 0;
+
+    p = zzlFirstInRange(zp,range);
+    if (p == NULL) return zp;
+
+    /* When the tail of the packed list is deleted, p will be NULL. */
+    while (p != NULL && zslKeyLteMax(zzlGetKey(p),range)) {
+        zp = zpkDelete(zp,&p);
+        num++;
+    }
+
+    if (deleted != NULL) *deleted = num;
+    return zp;
+}
+
+/* Delete all the elements with rank between start and end from the packed
+ * list. Start and end are inclusive. Note that start and end need to be
+ * 1-based */
+unsigned char *zzlDeleteRangeByRank(unsigned char *zp, unsigned long start, unsigned long end, unsigned long *deleted) {
+    unsigned long num = (end-start)+1;
+    if (deleted) *deleted = num;
+    return zpkDeleteRange(zp,start-1,num);
+}
+
+/*-----------------------------------------------------------------------------
+ * Common sorted set API
+ *----------------------------------------------------------------------------*/
+
+/* Return the number of bytes used by the sorted set, for MEMORY USAGE.
+ * Everything is accounted exactly except the skiplist nodes: up to
+ * ZSET_MEM_USAGE_SAMPLES nodes are measured, evenly spaced by rank, and
+ * their average size is used for the other ones, like Redis does for
+ * native sorted sets. Nodes allocated from a pool are accounted as the
+ * slabs of the pool instead. */
+size_t zsetMemUsage(const void *value) {
+    const zset *zs = value;
+    zskiplist *zsl = zs->zsl;
+    size_t size = sizeof(*zs), nodesize = 0;
+    unsigned long samples, j;
+
+    if (zs->encoding == ZSET_ENCODING_PACKED)
+        return size+zpkBlobLen(zs->zpk);
+
+    size += zsetDictMemUsage(zs->dict)+sizeof(*zsl);
+    size += sizeof(zskiplistNode)+ZSKIPLIST_MAXLEVEL*sizeof(struct zskiplistLevel);
+    if (zsl->zbt) size += zbtMemUsage(zsl->zbt);
+    if (zsl->pool) {
+        /* Nodes too big to be pooled are at least ZSLAB_MAX_OBJ bytes. */
+        return size+sizeof(*zsl->pool)+zsl->pool->slab_bytes+
+               zsl->pool->large_objs*ZSLAB_MAX_OBJ;
+    }
+
+    samples = zsl->length < ZSET_MEM_USAGE_SAMPLES ? zsl->length : ZSET_MEM_USAGE_SAMPLES;
+    if (samples == zsl->length) {
+        zskiplistNode *x;
+
+        for (x = zsl->header->level[0].forward; x; x = x->level[0].forward)
+            size += zslNodeMemUsage(zsl,x);
+        return size;
+    }
+    for (j = 0; j < samples; j++) {
+        unsigned long rank = 1+j*(zsl->length/samples);
+        nodesize += zslNodeMemUsage(zsl,zslGetElementByRank(zsl,rank));
+    }
+    return size+(size_t)((double)nodesize/samples*zsl->length);
+}
+
+/* Phases of zsetDefrag(), stored in the low bits of the cursor. */
+#define ZSET_DEFRAG_NODES 1     /* Cursor: rank of the next node. */
+#define ZSET_DEFRAG_ENTRIES 2   /* Cursor: dictScan() cursor. */
+#define ZSET_DEFRAG_PHASE_BITS 2
+
+typedef struct zsetDefragState {
+    RedisModuleDefragCtx *ctx;
+    zset *zs;
+} zsetDefragState;
+
+/* Relocate the skiplist node 'x' of 'zs', fixing the references to it:
+ * 'update' holds the nodes whose forward pointers reach it at each of its
+ * 'levels' levels. The B+tree references are up to the caller. Returns the
+ * new address of the node, or NULL if it was not moved. Pooled nodes are
+ * never moved: they live in the slabs of the set, not in their own
+ * allocation. */
+static zskiplistNode *zsetDefragNode(RedisModuleDefragCtx *ctx, zset *zs,
+                                     zskiplistNode *x, zskiplistNode **update,
+                                     int levels)
+{
+    zskiplist *zsl = zs->zsl;
+    size_t prefix = zslNodePrefixSize(x);
+    ptrdiff_t eleoff = x->ele-(char*)x;
+    zskiplistNode *newx;
+    char *buf;
+    int i;
+
+    if (zsl->pool) return NULL;
+    if ((buf = RedisModule_DefragAlloc(ctx,(char*)x-prefix)) == NULL)
+        return NULL;
+    newx = (zskiplistNode*)(buf+prefix);
+    if (!zsl->interned) newx->ele = (char*)newx+eleoff;
+
+    for (i = 0; i < levels; i++) {
+        update[i]->level[i].forward = newx;
+        if (zsl->rightmost[i] == x) zsl->rightmost[i] = newx;
+    }
+    for (i = 0; i < ZSL_CURSORS; i++)
+        if (zsl->cursor[i].node == x) zsl->cursor[i].node = newx;
+    if (newx->level[0].forward)
+        newx->level[0].forward->backward = newx;
+    else
+        zsl->tail = newx;
+    zsetDictRelocate(zs->dict,x,newx,!zsl->interned);
+    return newx;
+}
+
+static zbtNode *zsetDefragBtreeNode(zbtNode *n, void *privdata) {
+    zsetDefragState *state = privdata;
+    return RedisModule_DefragAlloc(state->ctx,n);
+}
+
+static zskiplistNode *zsetDefragBtreeEle(zskiplistNode *x, void *privdata) {
+    zsetDefragState *state = privdata;
+    zskiplistNode *update = x->backward ? x->backward : state->zs->zsl->header;
+
+    return zsetDefragNode(state->ctx,state->zs,x,&update,1);
+}
+
+/* Relocate the nodes of the skiplist, or of the B+tree and the skiplist,
+ * in rank order starting from 'rank'. Returns the rank to resume from if
+ * the defrag has to stop, 0 if all the nodes were visited. */
+static unsigned long zslDefragNodes(RedisModuleDefragCtx *ctx, zset *zs, unsigned long rank) {
+    zskiplist *zsl = zs->zsl;
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
+    unsigned long traversed = 0;
+    int i, levels;
+
+    if (zsl->zbt) {
+        zsetDefragState state = {ctx,zs};
 
+        while ((rank = zbtDefragLeaf(zsl->zbt,rank,zsetDefragBtreeNode,
+                                     zsetDefragBtreeEle,&state)) != 0)
+        {
+            if (RedisModule_DefragShouldStop(ctx)) return rank;
+        }
+        return 0;
+    }
+    if (zsl->pool) return 0;
+
+    /* Find the nodes that precede the node of rank 'rank' at every level. */
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                COMPARE_NODE_LTE(x->level[i].forward,score,timestamp,ele)) {
-            rank += x->level[i].span;
+        while (x->level[i].forward && traversed+zslSpan(x,i) < rank) {
+            traversed += zslSpan(x,i);
             x = x->level[i].forward;
         }
+        update[i] = x;
+    }
 
-        /* x might be equal to zsl->header, so test if obj is non-NULL */
-        if (x->ele && sdscmp(x->ele,ele) == 0) {
-            return rank;
-        }
+    x = update[0]->level[0].forward;
+    while (x) {
+        for (levels = 1; levels < zsl->level; levels++)
+            if (update[levels]->level[levels].forward != x) break;
+        if ((newx = zsetDefragNode(ctx,zs,x,update,levels)) != NULL) x = newx;
+        for (i = 0; i < levels; i++) update[i] = x;
+        x = x->level[0].forward;
+        rank++;
+        if (x && RedisModule_DefragShouldStop(ctx)) return rank;
     }
     return 0;
 }
 
-/* Finds an element by its rank. The rank argument needs to be 1-based. */
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
-    zskiplistNode *x;
-    unsigned long traversed = 0;
-    int i;
+/* Type defrag callback. The structures of the set are relocated first,
+ * then the nodes in rank order and finally the dict entries. The work is
+ * split across calls for large sets, resuming from a cursor that only
+ * holds a position, so the set can be modified between the calls. */
+int zsetDefrag(RedisModuleDefragCtx *ctx, RedisModuleString *key, void **value) {
+    zset *zs = *value, *newzs;
+    zskiplist *zsl;
+    unsigned long cursor, pos = 0;
+    int phase = 0, i;
+    void *moved;
+
+    DICT_NOTUSED(key);
+    if (RedisModule_DefragCursorGet(ctx,&cursor) == REDISMODULE_OK) {
+        phase = cursor & ((1<<ZSET_DEFRAG_PHASE_BITS)-1);
+        pos = cursor >> ZSET_DEFRAG_PHASE_BITS;
+    }
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
-        {
-            traversed += x->level[i].span;
-            x = x->level[i].forward;
-        }
-        if (traversed == rank) {
-            return x;
+    if ((newzs = RedisModule_DefragAlloc(ctx,zs)) != NULL) *value = zs = newzs;
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        if ((moved = RedisModule_DefragAlloc(ctx,zs->zpk)) != NULL) zs->zpk = moved;
+        return 0;
+    }
+
+    if (phase == 0) {
+        if ((moved = RedisModule_DefragAlloc(ctx,zs->zsl)) != NULL) zs->zsl = moved;
+        zsl = zs->zsl;
+        if ((moved = RedisModule_DefragAlloc(ctx,zsl->header)) != NULL) {
+            for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++)
+                if (zsl->rightmost[i] == zsl->header) zsl->rightmost[i] = moved;
+            zsl->header = moved;
         }
+        if (zsl->zbt && (moved = RedisModule_DefragAlloc(ctx,zsl->zbt)) != NULL) zsl->zbt = moved;
+        if (zsl->pool && (moved = RedisModule_DefragAlloc(ctx,zsl->pool)) != NULL) zsl->pool = moved;
+        zs->dict = zsetDictDefragTables(ctx,zs->dict);
+        phase = ZSET_DEFRAG_NODES;
+        pos = 1;
     }
-    return NULL;
+
+    if (phase == ZSET_DEFRAG_NODES) {
+        if ((pos = zslDefragNodes(ctx,zs,pos)) != 0) goto stop;
+        phase = ZSET_DEFRAG_ENTRIES;
+    }
+
+    while ((pos = zsetDictDefragEntries(ctx,zs->dict,pos)) != 0) {
+        if (RedisModule_DefragShouldStop(ctx)) goto stop;
+    }
+    return 0;
+
+stop:
+    RedisModule_DefragCursorSet(ctx,(pos << ZSET_DEFRAG_PHASE_BITS) | phase);
+    return 1;
 }
 
-/* Populate the rangespec according to the objects min and max. */
-static int zslParseRange(RedisModuleString *min, RedisModuleString *max, zrangespec *spec) {
-    char *eptr;
-    spec->minex = spec->maxex = 0;
+unsigned long zsetLength(const zset *zs) {
+    if (zs->encoding == ZSET_ENCODING_PACKED)
+        return zpkLen(zs->zpk);
+    return zs->zsl->length;
+}
 
-    /* Parse the min-max interval. If one of the values is prefixed
-     * by the "(" character, it's considered "open". For instance
-     * ZRANGEBYSCORE zset (1.5 (2.5 will match min < x < max
-     * ZRANGEBYSCORE zset 1.5 2.5 will instead match min <= x <= max */
-    {
-        size_t l;
-        const char *c = RedisModule_StringPtrLen(min, &l);
-        if (c[0] == '(') {
-            spec->min = strtod(c+1,&eptr);
-            if (eptr[0] != '\0' || isnan(spec->min)) return C_ERR;
-            spec->minex = 1;
-        } else {
-            spec->min = strtod(c,&eptr);
-            if (eptr[0] != '\0' || isnan(spec->min)) return C_ERR;
-        }
+/* Convert the sorted set object into the specified encoding. Only the
+ * conversion from the packed encoding to dict+skiplist is supported, as
+ * sets never shrink back to the packed encoding. */
+void zsetConvert(zset *zs, int encoding) {
+    unsigned char *zp, *p, *pele;
+    size_t plen;
+    double score;
+    long long timestamp;
+    uint64_t value;
+    int intmembers = ztsConfig.zset_int_members;
+    zskiplistNode *node;
+    sds ele = sdsempty();
+
+    if (zs->encoding == encoding) return;
+    serverAssert(zs->encoding == ZSET_ENCODING_PACKED &&
+                 encoding == ZSET_ENCODING_SKIPLIST);
+
+    /* Integer members are only used if all the members qualify. */
+    zp = zs->zpk;
+    for (p = zpkFirst(zp); p != NULL && intmembers; p = zpkNext(zp,p)) {
+        zpkGet(p,&pele,&plen,&score,&timestamp);
+        intmembers = zsetParseIntMember((const char*)pele,plen,&value);
     }
-    {
-        size_t l;
-        const char *c = RedisModule_StringPtrLen(max, &l);
-        if (c[0] == '(') {
-            spec->max = strtod(c+1,&eptr);
-            if (eptr[0] != '\0' || isnan(spec->max)) return C_ERR;
-            spec->maxex = 1;
-        } else {
-            spec->max = strtod(c,&eptr);
-            if (eptr[0] != '\0' || isnan(spec->max)) return C_ERR;
-        }
+    zsetInitSkiplist(zs,intmembers);
+    zsetDictExpand(zs->dict,zpkLen(zp));
+
+    for (p = zpkFirst(zp); p != NULL; p = zpkNext(zp,p)) {
+        zpkGet(p,&pele,&plen,&score,&timestamp);
+        ele = sdscpylen(ele,(const char*)pele,plen);
+        node = zslInsert(zs->zsl,score,timestamp,ele);
+        zsetDictAdd(zs->dict,node);
     }
 
-    return REDISMODULE_OK;
+    sdsfree(ele);
+    zpkFree(zp);
+    zs->zpk = NULL;
 }
 
-/*-----------------------------------------------------------------------------
- * Common sorted set API
- *----------------------------------------------------------------------------*/
+/* Turn a set of integer members into a set of string members, rebuilding
+ * its skiplist and member index. */
+static void zsetDisableIntMembers(zset *zs) {
+    zskiplist *zsl = zs->zsl;
+    zsetDict *dict = zs->dict;
+    zskiplistNode *x;
 
-double getScoreFromDictEntry(dictEntry *de) {
-    return ((zskiplistNode*)dictGetVal(de))->score;
+    serverAssert(zsl->intmembers);
+    zsetInitSkiplist(zs,0);
+    zsetDictExpand(zs->dict,zsl->length);
+    for (x = zsl->tail; x != NULL; x = x->backward)
+        zsetInsertNew(zs,x->score,zslNodeTimestamp(zsl,x),x->ele,NULL);
+    zsetDictRelease(dict);
+    zslFree(zsl);
 }
 
-long long getTimestampFromDictEntry(dictEntry *de) {
-    return ((zskiplistNode*)dictGetVal(de))->timestamp;
+/* Insert a new element in a dict+skiplist sorted set, that must not already
+ * contain 'ele'. A set of integer members is converted to a set of string
+ * members first when 'ele' is not an integer, which invalidates 'finger'.
+ * The skiplist search starts from 'finger' if not NULL, see zslInsertFrom().
+ * Returns the new node. */
+zskiplistNode *zsetInsertNew(zset *zs, double score, long long timestamp, sds ele, zslFinger *finger) {
+    zskiplistNode *node;
+    uint64_t value;
+
+    if (zs->zsl->intmembers && !zsetParseIntMember(ele,sdslen(ele),&value)) {
+        zsetDisableIntMembers(zs);
+        if (finger) finger->zsl = NULL;
+    }
+    node = zslInsertFrom(zs->zsl,finger,score,timestamp,ele);
+    zsetDictAdd(zs->dict,node);
+    return node;
 }
 
-unsigned int zsetLength(const zset *zs) {
-    return zs->zsl->length;
+/* Return the level of the node of rank 'rank' in a skiplist rebuilt by
+ * zsetCompact(): one node every four reaches level 2, one every sixteen
+ * level 3 and so on. This is the distribution of zslRandomLevel(), but
+ * with the taller nodes evenly spaced. */
+static int zslBalancedLevel(unsigned long rank) {
+    int level = 1;
+
+    while (level < ZSKIPLIST_MAXLEVEL && (rank & 3) == 0) {
+        rank >>= 2;
+        level++;
+    }
+    return level;
+}
+
+/* Rebuild the dict+skiplist of 'zs' so that nodes adjacent in rank order
+ * are adjacent in memory, and with balanced levels. The rebuilt set is
+ * pooled only if the old one was. The nodes of a pooled set are allocated
+ * in rank order from the shared blocks of its slab pool in sequential mode.
+ * The nodes of other sets are allocated in rank order with zmalloc(), so
+ * they are only as close as the allocator places them, but stay movable by
+ * active defragmentation. The old structures are released as a deleted
+ * set, so in the background with zset-lazy-free. Packed sets are left as
+ * they are, their entries are already contiguous. */
+void zsetCompact(zset *zs) {
+    zskiplist *oldzsl = zs->zsl, *zsl;
+    zskiplistNode *last[ZSKIPLIST_MAXLEVEL], *x, *node;
+    unsigned long lastrank[ZSKIPLIST_MAXLEVEL], rank = 0;
+    zsetDict *dict;
+    zset *old;
+    int i, level;
+
+    if (zs->encoding != ZSET_ENCODING_SKIPLIST) return;
+
+    zsl = zslCreate(oldzsl->zbt ? ZSET_ENGINE_BTREE : ZSET_ENGINE_SKIPLIST,
+                    oldzsl->pool != NULL,oldzsl->intmembers,oldzsl->interned);
+    if (zsl->pool) zslabSetSequential(zsl->pool,oldzsl->length);
+    dict = zsetDictCreate(oldzsl->intmembers);
+    zsetDictExpand(dict,oldzsl->length);
+
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        last[i] = zsl->header;
+        lastrank[i] = 0;
+    }
+    for (x = oldzsl->header->level[0].forward; x != NULL; x = x->level[0].forward) {
+        long long timestamp = zslNodeTimestamp(oldzsl,x);
+
+        rank++;
+        if (zsl->zbt) {
+            node = zslCreateNode(zsl,1,x->score,x->ele,timestamp);
+            zslBtreeInsert(zsl,node,x->score,timestamp);
+            zsetDictAdd(dict,node);
+            continue;
+        }
+
+        /* Append the node at every level it has. The spans of the last
+         * nodes of every level are fixed once all the nodes are linked. */
+        level = zslBalancedLevel(rank);
+        node = zslCreateNode(zsl,level,x->score,x->ele,timestamp);
+        for (i = 0; i < level; i++) {
+            node->level[i].forward = NULL;
+            last[i]->level[i].forward = node;
+            zslSetSpan(last[i],i,rank-lastrank[i]);
+            last[i] = node;
+            lastrank[i] = rank;
+        }
+        if (level > zsl->level) zsl->level = level;
+        node->backward = zsl->tail;
+        zsl->tail = node;
+        zsl->length++;
+        zsetDictAdd(dict,node);
+    }
+    if (!zsl->zbt) {
+        for (i = 0; i < zsl->level; i++)
+            zslSetSpan(last[i],i,zsl->length-lastrank[i]);
+        memcpy(zsl->rightmost,last,sizeof(last));
+    }
+    zsl->churn = 0;
+    zsl->cursor_hits = oldzsl->cursor_hits;
+    zsl->cursor_misses = oldzsl->cursor_misses;
+
+    old = zmalloc(sizeof(*old));
+    *old = *zs;
+    zs->zsl = zsl;
+    zs->dict = dict;
+    freeZsetObject(old);
 }
 
-/* Return (by reference) the score of the specified member of the sorted set
- * storing it into *score. If the element does not exist C_ERR is returned
- * otherwise C_OK is returned and *score is correctly populated.
+/* Return (by reference) the score and timestamp of the specified member of
+ * the sorted set storing them into *score and *timestamp (which may be NULL).
+ * If the element does not exist C_ERR is returned otherwise C_OK is returned
+ * and *score is correctly populated.
  * If 'zobj' or 'member' is NULL, C_ERR is returned. */
-int zsetScore(zset *zs, sds member, double *score) {
+int zsetScore(zset *zs, sds member, double *score, long long *timestamp) {
     if (!zs || !member) return C_ERR;
 
-    dictEntry *de = dictFind(zs->dict, member);
-    if (de == NULL) return C_ERR;
-    *score = getScoreFromDictEntry(de);
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        if (zzlFind(zs->zpk,member,score,timestamp) == NULL) return C_ERR;
+    } else {
+        zskiplistNode *node = zsetDictFind(zs->dict, member);
+        if (node == NULL) return C_ERR;
+        *score = node->score;
+        if (timestamp) *timestamp = zslNodeTimestamp(zs->zsl,node);
+    }
     return REDISMODULE_OK;
 }
 
@@ -603,13 +2249,20 @@ int zsetScore(zset *zs, sds member, double *score) {
  * start.
  *
  * The commad as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from packed to hashtable+skiplist.
  *
  * Memory managemnet of 'ele':
  *
- * The function does not take ownership of the 'ele' SDS string, but copies
- * it if needed. */
-int zsetAdd(zset *zs, double score, long long timestamp, sds ele, int *flags, double *newscore) {
+ * The function does not take ownership of the 'ele' SDS string, its bytes
+ * are copied into the skiplist node if needed.
+ *
+ * Skiplist finger:
+ *
+ * When 'finger' is not NULL a new element is inserted in the skiplist
+ * searching from the finger (see zslFinger), so the calls sharing it must
+ * add elements in ascending order. Updating the score of an element moves
+ * it, so the finger is invalidated. */
+int zsetAdd(zset *zs, double score, long long timestamp, sds ele, int *flags, double *newscore, zslFinger *finger) {
     /* Turn options into simple to check vars. */
     int incr = (*flags & ZADD_INCR) != 0;
     int nx = (*flags & ZADD_NX) != 0;
@@ -625,18 +2278,60 @@ int zsetAdd(zset *zs, double score, long long timestamp, sds ele, int *flags, do
     }
 
     /* Update the sorted set according to its encoding. */
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        unsigned char *eptr;
+
+        if ((eptr = zzlFind(zs->zpk,ele,&curscore,&curtimestamp)) != NULL) {
+            /* NX? Return, same element already exists. */
+            if (nx) {
+                *flags |= ZADD_NOP;
+                return 1;
+            }
+
+            /* Prepare the score for the increment if needed. */
+            if (incr) {
+                score += curscore;
+                if (isnan(score)) {
+                    *flags |= ZADD_NAN;
+                    return 0;
+                }
+            }
+
+            /* Remove and re-insert when score changed. */
+            if (score != curscore) {
+                zs->zpk = zpkDelete(zs->zpk,&eptr);
+                zs->zpk = zzlInsert(zs->zpk,ele,score,timestamp);
+                *flags |= ZADD_UPDATED;
+            }
+            if (newscore) *newscore = score;
+            return 1;
+        } else if (!xx) {
+            /* Convert to dict+skiplist when the packed list grows past
+             * the configured limits. */
+            zs->zpk = zzlInsert(zs->zpk,ele,score,timestamp);
+            if (zpkLen(zs->zpk) > ztsConfig.zset_max_packed_entries ||
+                sdslen(ele) > ztsConfig.zset_max_packed_value)
+                zsetConvert(zs,ZSET_ENCODING_SKIPLIST);
+            if (newscore) *newscore = score;
+            *flags |= ZADD_ADDED;
+            return 1;
+        } else {
+            *flags |= ZADD_NOP;
+            return 1;
+        }
+    }
+
     zskiplistNode *znode;
-    dictEntry *de;
 
-    de = dictFind(zs->dict,ele);
-    if (de != NULL) {
+    znode = zsetDictFind(zs->dict,ele);
+    if (znode != NULL) {
         /* NX? Return, same element already exists. */
         if (nx) {
             *flags |= ZADD_NOP;
             return 1;
         }
-        curscore = getScoreFromDictEntry(de);
-        curtimestamp = getTimestampFromDictEntry(de);
+        curscore = znode->score;
+        curtimestamp = zslNodeTimestamp(zs->zsl,znode);
 
         /* Prepare the score for the increment if needed. */
         if (incr) {
@@ -650,24 +2345,21 @@ int zsetAdd(zset *zs, double score, long long timestamp, sds ele, int *flags, do
         /* Remove and re-insert when score changes. */
         if (score != curscore) {
             zskiplistNode *node;
-            serverAssert(zslDelete(zs->zsl,curscore,curtimestamp,ele,&node));
-            znode = zslInsert(zs->zsl,score,timestamp,node->ele);
-            /* We reused the node->ele SDS string, free the node now
-             * since zslInsert created a new one. */
-            node->ele = NULL;
-            zslFreeNode(node);
-            /* Note that we did not removed the original element from
-             * the hash table representing the sorted set, so we just
-             * update the score. */
-            dictGetVal(de) = znode; /* Update score ptr. */
+            node = zslUpdateScore(zs->zsl,znode,curscore,curtimestamp,score,timestamp);
+            /* When the node could not be reused, make the hash table
+             * reference the new node, which embeds the member, before
+             * releasing the old one. */
+            if (node != znode) {
+                zsetDictReplace(zs->dict,znode,node);
+                zslFreeNode(zs->zsl,znode);
+            }
+            if (finger) finger->zsl = NULL;
             *flags |= ZADD_UPDATED;
         }
         if (newscore) *newscore = score;
         return 1;
     } else if (!xx) {
-        ele = sdsdup(ele);
-        znode = zslInsert(zs->zsl,score,timestamp,ele);
-        serverAssert(dictAdd(zs->dict,ele,znode) == DICT_OK);
+        zsetInsertNew(zs,score,timestamp,ele,finger);
         *flags |= ZADD_ADDED;
         if (newscore) *newscore = score;
         return 1;
@@ -682,28 +2374,35 @@ int zsetAdd(zset *zs, double score, long long timestamp, sds ele, int *flags, do
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(zset *zs, sds ele) {
-    dictEntry *de;
+    zskiplistNode *node;
     double score;
     long long timestamp;
 
-    de = dictUnlink(zs->dict,ele);
-    if (de != NULL) {
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        unsigned char *eptr;
+
+        if ((eptr = zzlFind(zs->zpk,ele,NULL,NULL)) != NULL) {
+            zs->zpk = zpkDelete(zs->zpk,&eptr);
+            return 1;
+        }
+        return 0;
+    }
+
+    node = zsetDictDelete(zs->dict,ele);
+    if (node != NULL) {
         /* Get the score in order to delete from the skiplist later. */
-        score = getScoreFromDictEntry(de);
-        timestamp = getTimestampFromDictEntry(de);
+        score = node->score;
+        timestamp = zslNodeTimestamp(zs->zsl,node);
 
         /* Delete from the hash table and later from the skiplist.
          * Note that the order is important: deleting from the skiplist
          * actually releases the SDS string representing the element,
          * which is shared between the skiplist and the hash table, so
          * we need to delete from the skiplist as the final step. */
-        dictFreeUnlinkedEntry(zs->dict,de);
-
-        /* Delete from skiplist. */
         int retval = zslDelete(zs->zsl,score,timestamp,ele,NULL);
         serverAssert(retval);
 
-        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        zsetDictResizeIfNeeded(zs->dict);
         return 1;
     }
     return 0; /* No such element found. */
@@ -724,15 +2423,27 @@ long zsetRank(zset *zs, sds ele, int reverse) {
     unsigned long llen = zsetLength(zs);
     unsigned long rank;
 
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        unsigned char *zp = zs->zpk, *p;
+
+        rank = 1;
+        for (p = zpkFirst(zp); p != NULL; p = zpkNext(zp,p)) {
+            if (zpkEqualMember(p,(unsigned char*)ele,sdslen(ele)))
+                return reverse ? llen-rank : rank-1;
+            rank++;
+        }
+        return -1;
+    }
+
     zskiplist *zsl = zs->zsl;
-    dictEntry *de;
+    zskiplistNode *node;
     double score;
     long long timestamp;
 
-    de = dictFind(zs->dict,ele);
-    if (de != NULL) {
-        score = getScoreFromDictEntry(de);
-        timestamp = getTimestampFromDictEntry(de);
+    node = zsetDictFind(zs->dict,ele);
+    if (node != NULL) {
+        score = node->score;
+        timestamp = zslNodeTimestamp(zsl,node);
         rank = zslGetRank(zsl,score,timestamp,ele);
         /* Existing elements always have a rank. */
         serverAssert(rank != 0);
@@ -748,7 +2459,65 @@ long zsetRank(zset *zs, sds ele, int reverse) {
  * Sorted set commands
  *----------------------------------------------------------------------------*/
 
-/* This generic command implements both ZADD and ZINCRBY. */
+/* An element of a ZADD command, see zaddGenericCommand(). */
+typedef struct zaddItem {
+    double score;
+    long long timestamp;
+    const char *ele;
+    size_t len;
+} zaddItem;
+
+/* qsort() comparator of zaddItem, in the order of the elements of a sorted
+ * set: score ascending, timestamp descending, member ascending. */
+static int zaddItemCompare(const void *a, const void *b) {
+    const zaddItem *x = a, *y = b;
+    size_t minlen;
+    int cmp;
+
+    if (x->score != y->score) return x->score < y->score ? -1 : 1;
+    if (x->timestamp != y->timestamp) return x->timestamp > y->timestamp ? -1 : 1;
+    minlen = x->len < y->len ? x->len : y->len;
+    if ((cmp = memcmp(x->ele,y->ele,minlen)) != 0) return cmp;
+    return x->len < y->len ? -1 : (x->len > y->len);
+}
+
+/* Return 1 if the same member appears more than once in 'items'. The
+ * members are hashed in a temporary open addressing table. */
+static int zaddHasDuplicates(zaddItem *items, int count) {
+    unsigned long size = 4, mask, idx;
+    zaddItem **table;
+    int j, found = 0;
+
+    while (size < (unsigned long)count*2) size *= 2;
+    mask = size-1;
+    table = zcalloc(sizeof(zaddItem*)*size);
+    for (j = 0; j < count && !found; j++) {
+        idx = dictGenHashFunction(items[j].ele,items[j].len) & mask;
+        while (table[idx]) {
+            if (table[idx]->len == items[j].len &&
+                memcmp(table[idx]->ele,items[j].ele,items[j].len) == 0)
+            {
+                found = 1;
+                break;
+            }
+            idx = (idx+1) & mask;
+        }
+        table[idx] = &items[j];
+    }
+    zfree(table);
+    return found;
+}
+
+/* This generic command implements both ZADD and ZINCRBY.
+ *
+ * When several elements are given they are added in the order of the set,
+ * so that the skiplist insertions resume from the position of the previous
+ * one (see zslFinger) and a batch of ascending elements is added in about
+ * linear time. The index lookups of the next members are prefetched. The
+ * elements are sorted only when no member is repeated: each element then
+ * touches a different member, so the order doesn't change the result, the
+ * reply or what is replicated, while with repeated members the last one
+ * must win as if they were added one after the other. */
 int zaddGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
         int flags)
 {
@@ -756,9 +2525,11 @@ int zaddGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
     RedisModuleKey *key = NULL;
     zset *zobj = NULL;
     sds ele = NULL;
-    double score = 0, *scores = NULL;
-    long long timestamp = 0, curtimestamp = 0, *timestamps = NULL;
-    int j, elements;
+    double score = 0;
+    long long curtimestamp = 0;
+    zaddItem *items = NULL;
+    zslFinger finger;
+    int j, elements, sorted = 0, prefetched = 0;
     int scoreidx = 0;
     /* The following vars are used in order to track what the command actually
      * did during the execution, to reply to the client and to trigger the
@@ -830,33 +2601,48 @@ int zaddGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
     /* Start parsing all the scores, we need to emit any syntax error
      * before executing additions to the sorted set, as the command should
      * either execute fully or nothing at all. */
-    scores = zmalloc(sizeof(double)*elements);
-    timestamps = zmalloc(sizeof(long long)*elements);
+    items = zmalloc(sizeof(zaddItem)*elements);
     int step = 3, eleoffset = 2;
     if (!ts) {
-        memset(timestamps, 0, sizeof(long long)*elements);
         step = 2;
         eleoffset = 1;
         curtimestamp = RedisModule_Milliseconds();
     }
     for (j = 0; j < elements; j++) {
-        if ((ret=RedisModule_StringToDouble(argv[scoreidx+j*step],&scores[j]))
+        items[j].timestamp = 0;
+        if ((ret=RedisModule_StringToDouble(argv[scoreidx+j*step],&items[j].score))
             != REDISMODULE_OK) {
             ret = RedisModule_ReplyWithError(ctx,"value is not a valid float");
             goto cleanup;
         }
-        if (ts && (ret=RedisModule_StringToLongLong(argv[scoreidx+1+j*step],&timestamps[j]))
+        if (ts && (ret=RedisModule_StringToLongLong(argv[scoreidx+1+j*step],&items[j].timestamp))
             != REDISMODULE_OK) {
             ret = RedisModule_ReplyWithError(ctx,"timestamp is not a valid long long");
             goto cleanup;
         }
+        /* Set timestamp with current time if it is 0 */
+        if (items[j].timestamp == 0) items[j].timestamp = curtimestamp;
+        items[j].ele = RedisModule_StringPtrLen(argv[scoreidx+eleoffset+j*step],&items[j].len);
     }
+    if (elements > 1 && !zaddHasDuplicates(items,elements)) {
+        qsort(items,elements,sizeof(zaddItem),zaddItemCompare);
+        sorted = 1;
+    }
+    finger.zsl = NULL;
 
     /* Lookup the key and create the sorted set if does not exist. */
     key = RedisModule_OpenKey(ctx,argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
     if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
         if (xx) goto reply_to_client; /* No key + XX option: nothing to do. */
-        zobj = createZsetObject();
+        size_t l;
+        RedisModule_StringPtrLen(argv[scoreidx+eleoffset], &l);
+        if (ztsConfig.zset_max_packed_entries == 0 ||
+            ztsConfig.zset_max_packed_value < l)
+        {
+            zobj = createZsetObject();
+        } else {
+            zobj = createZsetPackedObject();
+        }
         RedisModule_ModuleTypeSetValue(key,ZSetTsType,zobj);
     } else {
         if (RedisModule_ModuleTypeGetType(key) != ZSetTsType) {
@@ -868,21 +2654,24 @@ int zaddGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
 
     ele = sdsempty();
 
+    /* Many elements are written at once: drop the cursors instead of
+     * adjusting them for every element. */
+    if (elements > 1 && zobj->encoding == ZSET_ENCODING_SKIPLIST)
+        zslCursorsReset(zobj->zsl);
+
     for (j = 0; j < elements; j++) {
         double newscore;
-        score = scores[j];
-        timestamp = timestamps[j];
+        zaddItem *item = &items[j];
         int retflags = flags;
 
-        /* Set timestamp with current time if it is 0 */
-        if (timestamp == 0) {
-            timestamp = curtimestamp;
+        if (zobj->encoding == ZSET_ENCODING_SKIPLIST) {
+            for (; prefetched < elements && prefetched <= j+ZADD_PREFETCH_DISTANCE; prefetched++)
+                zsetDictPrefetch(zobj->dict,items[prefetched].ele,items[prefetched].len);
         }
 
-        size_t l;
-		const char *c = RedisModule_StringPtrLen(argv[scoreidx+eleoffset+j*step], &l);
-        ele = sdscpylen(ele, c, l);
-        int retval = zsetAdd(zobj, score, timestamp, ele, &retflags, &newscore);
+        ele = sdscpylen(ele, item->ele, item->len);
+        int retval = zsetAdd(zobj, item->score, item->timestamp, ele, &retflags, &newscore,
+            sorted ? &finger : NULL);
         if (retval == 0) {
             ret = RedisModule_ReplyWithError(ctx,nanerr);
             goto cleanup;
@@ -895,7 +2684,7 @@ int zaddGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
         /* Replicate to slave/aof. */
         if (!(retflags & ZADD_NOP)) {
 			snprintf(scorebuf, sizeof(scorebuf), "%f", newscore);
-			RedisModule_Replicate(ctx,"ZTS.ZADD","scclb",argv[1],"TS",scorebuf,timestamp,c,l);
+			RedisModule_Replicate(ctx,"ZTS.ZADD","scclb",argv[1],"TS",scorebuf,item->timestamp,item->ele,item->len);
         }
     }
 
@@ -913,8 +2702,7 @@ cleanup:
     /*if (key) {
         RedisModule_CloseKey(key);
     }*/
-    zfree(scores);
-    zfree(timestamps);
+    zfree(items);
     sdsfree(ele);
     return ret;
 }
@@ -942,6 +2730,8 @@ int zremCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         return RedisModule_ReplyWithLongLong(ctx,0);
 
     zobj = (zset *)RedisModule_ModuleTypeGetValue(key);
+    if (argc > 3 && zobj->encoding == ZSET_ENCODING_SKIPLIST)
+        zslCursorsReset(zobj->zsl);
 
     for (j = 2; j < argc; j++) {
         ele = sdsFromRedisModuleString(ele, argv[j]);
@@ -1009,15 +2799,26 @@ int zremrangeGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int a
     }
 
     /* Step 3: Perform the range deletion operation. */
-	switch(rangetype) {
-	case ZRANGE_RANK:
-		deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
-		break;
-	case ZRANGE_SCORE:
-		deleted = zslDeleteRangeByScore(zs->zsl,&range,zs->dict);
-		break;
+	if (zs->encoding == ZSET_ENCODING_PACKED) {
+		switch(rangetype) {
+		case ZRANGE_RANK:
+			zs->zpk = zzlDeleteRangeByRank(zs->zpk,start+1,end+1,&deleted);
+			break;
+		case ZRANGE_SCORE:
+			zs->zpk = zzlDeleteRangeByScore(zs->zpk,&range,&deleted);
+			break;
+		}
+	} else {
+		switch(rangetype) {
+		case ZRANGE_RANK:
+			deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
+			break;
+		case ZRANGE_SCORE:
+			deleted = zslDeleteRangeByScore(zs->zsl,&range,zs->dict);
+			break;
+		}
+		zsetDictResizeIfNeeded(zs->dict);
 	}
-	if (htNeedsResize(zs->dict)) dictResize(zs->dict);
 	if (zsetLength(zs) == 0) {
 		RedisModule_DeleteKey(key);
 	}
@@ -1072,7 +2873,7 @@ int zscoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     zobj = (zset *)RedisModule_ModuleTypeGetValue(key);
 
     ele = sdsFromRedisModuleString(ele, argv[2]);
-    retval = zsetScore(zobj,ele,&score);
+    retval = zsetScore(zobj,ele,&score,NULL);
     sdsfree(ele);
     if (retval == C_ERR) {
         return RedisModule_ReplyWithNull(ctx);
@@ -1098,15 +2899,12 @@ int zscoretsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     zobj = (zset *)RedisModule_ModuleTypeGetValue(key);
 
     ele = sdsFromRedisModuleString(ele, argv[2]);
-    dictEntry *de = dictFind(zobj->dict, ele);
+    int retval = zsetScore(zobj,ele,&score,&timestamp);
     sdsfree(ele);
-	if (de == NULL) {
+	if (retval == C_ERR) {
     	return RedisModule_ReplyWithArray(ctx,0);
     }
 
-	score = getScoreFromDictEntry(de);
-	timestamp = getTimestampFromDictEntry(de);
-
 	RedisModule_ReplyWithArray(ctx,2);
 	RedisModule_ReplyWithDouble(ctx,score);
     return RedisModule_ReplyWithLongLong(ctx,timestamp);
@@ -1153,8 +2951,8 @@ int zrangeGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
     int withscores = 0, withtimestamps = 0;
     long long start;
     long long end;
-    int llen;
-    int rangelen;
+    long long llen;
+    long long rangelen;
     int argindex = 0;
     int resultnum = 1;
 
@@ -1204,19 +3002,47 @@ int zrangeGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
     /* Return the result in form of a multi-bulk reply */
     RedisModule_ReplyWithArray(ctx, rangelen*resultnum);
 
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        unsigned char *zp = zs->zpk;
+        unsigned char *eptr, *pele;
+        size_t plen;
+        double score;
+        long long timestamp;
+
+        if (reverse)
+            eptr = zpkSeek(zp,-start-1);
+        else
+            eptr = zpkSeek(zp,start);
+
+        while (rangelen--) {
+            serverAssertWithInfo(ctx,zs,eptr != NULL);
+            zpkGet(eptr,&pele,&plen,&score,&timestamp);
+            RedisModule_ReplyWithStringBuffer(ctx,(const char*)pele,plen);
+            if (withscores)
+                RedisModule_ReplyWithDouble(ctx,score);
+            if (withtimestamps)
+                RedisModule_ReplyWithLongLong(ctx,timestamp);
+            eptr = reverse ? zpkPrev(zp,eptr) : zpkNext(zp,eptr);
+        }
+        return 0;
+    }
+
     zskiplist *zsl = zs->zsl;
-    zskiplistNode *ln;
+    zskiplistNode *ln, *last = NULL;
+    int slot = -1;
     sds ele;
 
-    /* Check if starting point is trivial, before doing log(N) lookup. */
+    /* Check if starting point is trivial, before doing log(N) lookup.
+     * Otherwise a page that follows a previous one starts from the cursor
+     * it left. */
     if (reverse) {
         ln = zsl->tail;
         if (start > 0)
-            ln = zslGetElementByRank(zsl,llen-start);
+            ln = zslCursorGetElementByRank(zsl,llen-start,&slot);
     } else {
         ln = zsl->header->level[0].forward;
         if (start > 0)
-            ln = zslGetElementByRank(zsl,start+1);
+            ln = zslCursorGetElementByRank(zsl,start+1,&slot);
     }
 
     while(rangelen--) {
@@ -1226,9 +3052,11 @@ int zrangeGenericCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc
         if (withscores)
             RedisModule_ReplyWithDouble(ctx,ln->score);
         if (withtimestamps)
-            RedisModule_ReplyWithLongLong(ctx,ln->timestamp);
+            RedisModule_ReplyWithLongLong(ctx,zslNodeTimestamp(zsl,ln));
+        last = ln;
         ln = reverse ? ln->backward : ln->level[0].forward;
     }
+    zslCursorSet(zsl,slot,last,reverse ? llen-end : end+1);
 
     return 0;
 }
@@ -1241,6 +3069,126 @@ int zrevrangeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     return zrangeGenericCommand(ctx,argv,argc,1);
 }
 
+/* ZTS.ZRANGEAFTER key member count [REV] [ANCHOR score timestamp]
+ *                 [WITHSCORES] [WITHTIMESTAMPS]
+ *
+ * Keyset pagination: return up to 'count' elements that follow 'member' in
+ * the order of the set, or that precede it from the highest to the lowest
+ * with REV. The last member of a page is the anchor of the next one, so a
+ * page doesn't depend on the elements added or removed before it. The
+ * anchor is found in the dict and the elements are walked from there, so a
+ * page costs O(count) at any depth. With ANCHOR the anchor is the element
+ * with the given score, timestamp and member, that doesn't need to be in
+ * the set (the member may have been removed or updated since it was
+ * returned) and is searched in O(log(N)). Without ANCHOR a null reply is
+ * returned if the member is not in the set. */
+int zrangeafterCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModuleKey *key = NULL;
+    zset *zs = NULL;
+    int withscores = 0, withtimestamps = 0, reverse = 0, anchor = 0;
+    double score = 0;
+    long long timestamp = 0, count;
+    long rangelen = 0;
+    int argindex;
+    int resultnum = 1;
+    sds ele;
+
+    if (argc < 4) return RedisModule_WrongArity(ctx);
+
+    RedisModule_AutoMemory(ctx);
+
+    if (RedisModule_StringToLongLong(argv[3],&count) != REDISMODULE_OK)
+        return RedisModule_ReplyWithNull(ctx);
+
+    for (argindex = 4; argindex < argc; ++argindex) {
+        size_t l;
+        const char *opt = RedisModule_StringPtrLen(argv[argindex], &l);
+        if (!strcasecmp(opt,"withscores")) {
+            withscores = 1;
+            ++resultnum;
+        } else if (!strcasecmp(opt,"withtimestamps")) {
+            withtimestamps = 1;
+            ++resultnum;
+        } else if (!strcasecmp(opt,"rev")) {
+            reverse = 1;
+        } else if (!strcasecmp(opt,"anchor") && argindex+2 < argc) {
+            if ((RedisModule_StringToDouble(argv[argindex+1],&score) != REDISMODULE_OK) ||
+                (RedisModule_StringToLongLong(argv[argindex+2],&timestamp) != REDISMODULE_OK))
+            {
+                return RedisModule_ReplyWithNull(ctx);
+            }
+            anchor = 1;
+            argindex += 2;
+        } else {
+            return RedisModule_WrongArity(ctx);
+        }
+    }
+
+    key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (key == NULL || RedisModule_ModuleTypeGetType(key) != ZSetTsType || count <= 0)
+        return RedisModule_ReplyWithArray(ctx, 0);
+
+    zs = (zset *)RedisModule_ModuleTypeGetValue(key);
+    ele = sdsFromRedisModuleString(NULL, argv[2]);
+
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        unsigned char *zp = zs->zpk;
+        unsigned char *eptr, *pele;
+        size_t plen;
+
+        if (anchor) {
+            eptr = zzlNextToElement(zp,score,timestamp,ele,reverse);
+        } else {
+            if ((eptr = zzlFind(zp,ele,NULL,NULL)) == NULL) {
+                sdsfree(ele);
+                return RedisModule_ReplyWithNull(ctx);
+            }
+            eptr = reverse ? zpkPrev(zp,eptr) : zpkNext(zp,eptr);
+        }
+        sdsfree(ele);
+
+        RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
+        while (eptr && count--) {
+            zpkGet(eptr,&pele,&plen,&score,&timestamp);
+            RedisModule_ReplyWithStringBuffer(ctx,(const char*)pele,plen);
+            if (withscores)
+                RedisModule_ReplyWithDouble(ctx,score);
+            if (withtimestamps)
+                RedisModule_ReplyWithLongLong(ctx,timestamp);
+            rangelen++;
+            eptr = reverse ? zpkPrev(zp,eptr) : zpkNext(zp,eptr);
+        }
+    } else {
+        zskiplist *zsl = zs->zsl;
+        zskiplistNode *ln;
+
+        if (anchor) {
+            ln = zslNextToElement(zsl,score,timestamp,ele,reverse);
+        } else {
+            if ((ln = zsetDictFind(zs->dict,ele)) == NULL) {
+                sdsfree(ele);
+                return RedisModule_ReplyWithNull(ctx);
+            }
+            ln = reverse ? ln->backward : ln->level[0].forward;
+        }
+        sdsfree(ele);
+
+        RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
+        while (ln && count--) {
+            RedisModule_ReplyWithStringBuffer(ctx,ln->ele,sdslen(ln->ele));
+            if (withscores)
+                RedisModule_ReplyWithDouble(ctx,ln->score);
+            if (withtimestamps)
+                RedisModule_ReplyWithLongLong(ctx,zslNodeTimestamp(zsl,ln));
+            rangelen++;
+            ln = reverse ? ln->backward : ln->level[0].forward;
+        }
+    }
+
+    RedisModule_ReplySetArrayLength(ctx,rangelen*resultnum);
+    return 0;
+}
+
 /* This command implements ZRANGEBYSCORE, ZREVRANGEBYSCORE. */
 int genericZrangebyscoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, int reverse) {
     zrangespec range;
@@ -1307,60 +3255,132 @@ int genericZrangebyscoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv, i
 		return RedisModule_ReplyWithNull(ctx);
 
 	zs = (zset *)RedisModule_ModuleTypeGetValue(key);
-	zskiplist *zsl = zs->zsl;
-	zskiplistNode *ln;
-
-	/* If reversed, get the last node in range as starting point. */
-	if (reverse) {
-		ln = zslLastInRange(zsl,&range);
-	} else {
-		ln = zslFirstInRange(zsl,&range);
-	}
 
-	/* No "first" element in the specified interval. */
-	if (ln == NULL) {
-		return RedisModule_ReplyWithArray(ctx, 0);
-	}
-
-	/* We don't know in advance how many matching elements there are in the
-	 * list, so we push this object that will represent the multi-bulk
-	 * length in the output buffer, and will "fix" it later */
-	RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
+	if (zs->encoding == ZSET_ENCODING_PACKED) {
+		unsigned char *zp = zs->zpk;
+		unsigned char *eptr, *pele;
+		size_t plen;
+		double score;
+		long long timestamp;
 
-	/* If there is an offset, just traverse the number of elements without
-	 * checking the score because that is done in the next loop. */
-	while (ln && offset--) {
+		/* If reversed, get the last node in range as starting point. */
 		if (reverse) {
-			ln = ln->backward;
+			eptr = zzlLastInRange(zp,&range);
 		} else {
-			ln = ln->level[0].forward;
+			eptr = zzlFirstInRange(zp,&range);
 		}
-	}
 
-	while (ln && limit--) {
-		/* Abort when the node is no longer in range. */
-		if (reverse) {
-			if (!zslValueGteMin(ln->score,&range)) break;
-		} else {
-			if (!zslValueLteMax(ln->score,&range)) break;
+		/* No "first" element in the specified interval. */
+		if (eptr == NULL) {
+			return RedisModule_ReplyWithArray(ctx, 0);
 		}
 
-		rangelen++;
-		RedisModule_ReplyWithStringBuffer(ctx,ln->ele,sdslen(ln->ele));
-
-		if (withscores) {
-			RedisModule_ReplyWithDouble(ctx,ln->score);
+		/* We don't know in advance how many matching elements there are in the
+		 * list, so we push this object that will represent the multi-bulk
+		 * length in the output buffer, and will "fix" it later */
+		RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
+
+		/* If there is an offset, just traverse the number of elements without
+		 * checking the score because that is done in the next loop. */
+		while (eptr && offset--) {
+			if (reverse) {
+				eptr = zpkPrev(zp,eptr);
+			} else {
+				eptr = zpkNext(zp,eptr);
+			}
 		}
 
-		if (withtimestamps) {
-			RedisModule_ReplyWithLongLong(ctx,ln->timestamp);
+		while (eptr && limit--) {
+			zpkGet(eptr,&pele,&plen,&score,&timestamp);
+
+			/* Abort when the node is no longer in range. */
+			if (reverse) {
+				if (!zslKeyGteMin(zslMakeKey(score,timestamp),&range)) break;
+			} else {
+				if (!zslKeyLteMax(zslMakeKey(score,timestamp),&range)) break;
+			}
+
+			rangelen++;
+			RedisModule_ReplyWithStringBuffer(ctx,(const char*)pele,plen);
+
+			if (withscores) {
+				RedisModule_ReplyWithDouble(ctx,score);
+			}
+
+			if (withtimestamps) {
+				RedisModule_ReplyWithLongLong(ctx,timestamp);
+			}
+
+			/* Move to next node */
+			if (reverse) {
+				eptr = zpkPrev(zp,eptr);
+			} else {
+				eptr = zpkNext(zp,eptr);
+			}
 		}
+	} else {
+		zskiplist *zsl = zs->zsl;
+		zskiplistNode *ln;
+		unsigned long rank;
 
-		/* Move to next node */
+		/* If reversed, get the last node in range as starting point. */
 		if (reverse) {
-			ln = ln->backward;
+			ln = zslLastInRange(zsl,&range,&rank);
 		} else {
-			ln = ln->level[0].forward;
+			ln = zslFirstInRange(zsl,&range,&rank);
+		}
+
+		/* No "first" element in the specified interval. */
+		if (ln == NULL) {
+			return RedisModule_ReplyWithArray(ctx, 0);
+		}
+
+		/* We don't know in advance how many matching elements there are in the
+		 * list, so we push this object that will represent the multi-bulk
+		 * length in the output buffer, and will "fix" it later */
+		RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
+
+		/* If there is an offset, jump to the element 'offset' positions
+		 * away from the starting point by rank, like zslGetElementByRank()
+		 * does, instead of walking the elements in between. The score is
+		 * checked in the next loop. A negative offset selects nothing. */
+		if (offset < 0) {
+			ln = NULL;
+		} else if (offset > 0) {
+			if (reverse) {
+				ln = (unsigned long long)offset < rank ?
+					zslGetElementByRank(zsl,rank-offset) : NULL;
+			} else {
+				ln = (unsigned long long)offset <= zsl->length-rank ?
+					zslGetElementByRank(zsl,rank+offset) : NULL;
+			}
+		}
+
+		while (ln && limit--) {
+			/* Abort when the node is no longer in range. */
+			if (reverse) {
+				if (!zslKeyGteMin(zslNodeKey(zsl,ln),&range)) break;
+			} else {
+				if (!zslKeyLteMax(zslNodeKey(zsl,ln),&range)) break;
+			}
+
+			rangelen++;
+			RedisModule_ReplyWithStringBuffer(ctx,ln->ele,sdslen(ln->ele));
+
+			if (withscores) {
+				RedisModule_ReplyWithDouble(ctx,ln->score);
+			}
+
+			if (withtimestamps) {
+				RedisModule_ReplyWithLongLong(ctx,zslNodeTimestamp(zsl,ln));
+			}
+
+			/* Move to next node */
+			if (reverse) {
+				ln = ln->backward;
+			} else {
+				ln = ln->level[0].forward;
+			}
 		}
 	}
 
@@ -1382,7 +3402,7 @@ int zcountCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModuleKey *key = NULL;
     zset *zs = NULL;
     zrangespec range;
-    int count = 0;
+    unsigned long count = 0;
 
     if (argc < 4) return RedisModule_WrongArity(ctx);
 
@@ -1399,27 +3419,164 @@ int zcountCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
 		return RedisModule_ReplyWithLongLong(ctx, count);
 
 	zs = (zset *)RedisModule_ModuleTypeGetValue(key);
-	zskiplist *zsl = zs->zsl;
-	zskiplistNode *zn;
-	unsigned long rank;
-
-	/* Find first element in range */
-	zn = zslFirstInRange(zsl, &range);
 
-	/* Use rank of first element, if any, to determine preliminary count */
-	if (zn != NULL) {
-		rank = zslGetRank(zsl, zn->score, zn->timestamp, zn->ele);
-		count = (zsl->length - (rank - 1));
+	if (zs->encoding == ZSET_ENCODING_PACKED) {
+		unsigned char *zp = zs->zpk;
+		unsigned char *eptr;
 
-		/* Find last element in range */
-		zn = zslLastInRange(zsl, &range);
+		/* Use the first element in range as starting point */
+		eptr = zzlFirstInRange(zp,&range);
 
-		/* Use rank of last element, if any, to determine the actual count */
-		if (zn != NULL) {
-			rank = zslGetRank(zsl, zn->score, zn->timestamp, zn->ele);
-			count -= (zsl->length - rank);
+		/* Iterate over elements in range */
+		while (eptr) {
+			/* Abort when the node is no longer in range. */
+			if (!zslKeyLteMax(zzlGetKey(eptr),&range)) break;
+			count++;
+			eptr = zpkNext(zp,eptr);
+		}
+	} else {
+		zskiplist *zsl = zs->zsl;
+		unsigned long first, last;
+
+		/* The range lookups return the ranks of the first and last
+		 * elements in range, accumulated from the spans during the
+		 * descents, so only scores are compared. When there is a first
+		 * element there is a last one too. */
+		if (zslFirstInRange(zsl, &range, &first) != NULL &&
+			zslLastInRange(zsl, &range, &last) != NULL)
+		{
+			count = last - first + 1;
 		}
 	}
 
     return RedisModule_ReplyWithLongLong(ctx, count);
 }
+
+/* ZTS.STATS key
+ *
+ * Return internal information about the representation of a sorted set as
+ * a flat list of field/value pairs, including the statistics of the node
+ * slab pool when the set uses one. */
+int zstatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModuleKey *key = NULL;
+    zset *zs = NULL;
+    zslabPool *pool = NULL;
+    long fields = 0;
+
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+
+    RedisModule_AutoMemory(ctx);
+
+    key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (key == NULL || RedisModule_ModuleTypeGetType(key) != ZSetTsType)
+        return RedisModule_ReplyWithArray(ctx,0);
+
+    zs = (zset *)RedisModule_ModuleTypeGetValue(key);
+
+    RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
+    RedisModule_ReplyWithSimpleString(ctx,"encoding");
+    if (zs->encoding == ZSET_ENCODING_PACKED) {
+        RedisModule_ReplyWithSimpleString(ctx,"packed");
+    } else {
+        RedisModule_ReplyWithSimpleString(ctx,zs->zsl->zbt ? "btree" : "skiplist");
+        pool = zs->zsl->pool;
+    }
+    RedisModule_ReplyWithSimpleString(ctx,"length");
+    RedisModule_ReplyWithLongLong(ctx,zsetLength(zs));
+    fields += 2;
+    if (zs->encoding != ZSET_ENCODING_PACKED) {
+        RedisModule_ReplyWithSimpleString(ctx,"int-members");
+        RedisModule_ReplyWithLongLong(ctx,zs->zsl->intmembers);
+        RedisModule_ReplyWithSimpleString(ctx,"interned");
+        RedisModule_ReplyWithLongLong(ctx,zs->zsl->interned);
+        RedisModule_ReplyWithSimpleString(ctx,"churn");
+        RedisModule_ReplyWithLongLong(ctx,zs->zsl->churn);
+        RedisModule_ReplyWithSimpleString(ctx,"cursor-hits");
+        RedisModule_ReplyWithLongLong(ctx,zs->zsl->cursor_hits);
+        RedisModule_ReplyWithSimpleString(ctx,"cursor-misses");
+        RedisModule_ReplyWithLongLong(ctx,zs->zsl->cursor_misses);
+        fields += 5;
+    }
+
+    if (pool) {
+        RedisModule_ReplyWithSimpleString(ctx,"pool-slabs");
+        RedisModule_ReplyWithLongLong(ctx,pool->slab_count);
+        RedisModule_ReplyWithSimpleString(ctx,"pool-slab-bytes");
+        RedisModule_ReplyWithLongLong(ctx,pool->slab_bytes);
+        RedisModule_ReplyWithSimpleString(ctx,"pool-used-bytes");
+        RedisModule_ReplyWithLongLong(ctx,pool->used_bytes);
+        RedisModule_ReplyWithSimpleString(ctx,"pool-free-nodes");
+        RedisModule_ReplyWithLongLong(ctx,pool->free_objs);
+        RedisModule_ReplyWithSimpleString(ctx,"pool-large-nodes");
+        RedisModule_ReplyWithLongLong(ctx,pool->large_objs);
+        fields += 5;
+    }
+    RedisModule_ReplySetArrayLength(ctx,fields*2);
+    return REDISMODULE_OK;
+}
+
+/* ZTS.COMPACT key
+ *
+ * Rebuild a sorted set with zsetCompact(), so that range scans walk memory
+ * sequentially. Returns the time taken in microseconds and the memory used
+ * by the set before and after the rebuild, as reported by MEMORY USAGE, as
+ * field/value pairs. The logical content of the set is unchanged, so the
+ * command is not propagated. */
+int zcompactCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModuleKey *key = NULL;
+    zset *zs = NULL;
+    long long start, elapsed;
+    size_t before, after;
+
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+
+    RedisModule_AutoMemory(ctx);
+
+    key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    if (key == NULL || RedisModule_ModuleTypeGetType(key) != ZSetTsType)
+        return RedisModule_ReplyWithArray(ctx,0);
+
+    zs = (zset *)RedisModule_ModuleTypeGetValue(key);
+
+    before = zsetMemUsage(zs);
+    start = ustime();
+    zsetCompact(zs);
+    elapsed = ustime()-start;
+    after = zsetMemUsage(zs);
+
+    RedisModule_ReplyWithArray(ctx,8);
+    RedisModule_ReplyWithSimpleString(ctx,"time-us");
+    RedisModule_ReplyWithLongLong(ctx,elapsed);
+    RedisModule_ReplyWithSimpleString(ctx,"bytes-before");
+    RedisModule_ReplyWithLongLong(ctx,before);
+    RedisModule_ReplyWithSimpleString(ctx,"bytes-after");
+    RedisModule_ReplyWithLongLong(ctx,after);
+    RedisModule_ReplyWithSimpleString(ctx,"bytes-reclaimed");
+    RedisModule_ReplyWithLongLong(ctx,(long long)before-(long long)after);
+    return REDISMODULE_OK;
+}
+
+/* ZTS.INTERNSTATS
+ * Return the statistics of the module wide intern table of members (see
+ * zintern.h) as field/value pairs. */
+int zinternstatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    zinternStats stats;
+
+    DICT_NOTUSED(argv);
+    if (argc != 1) return RedisModule_WrongArity(ctx);
+
+    zinternGetStats(&stats);
+
+    RedisModule_ReplyWithArray(ctx,10);
+    RedisModule_ReplyWithSimpleString(ctx,"enabled");
+    RedisModule_ReplyWithLongLong(ctx,ztsConfig.zset_intern_members);
+    RedisModule_ReplyWithSimpleString(ctx,"strings");
+    RedisModule_ReplyWithLongLong(ctx,stats.strings);
+    RedisModule_ReplyWithSimpleString(ctx,"refs");
+    RedisModule_ReplyWithLongLong(ctx,stats.refs);
+    RedisModule_ReplyWithSimpleString(ctx,"bytes");
+    RedisModule_ReplyWithLongLong(ctx,stats.bytes);
+    RedisModule_ReplyWithSimpleString(ctx,"bytes-saved");
+    RedisModule_ReplyWithLongLong(ctx,stats.saved);
+    return REDISMODULE_OK;
+}
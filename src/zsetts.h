@@ -1,36 +1,324 @@
 #ifndef __ZSET_TS_ZSETTS_H
 #define __ZSET_TS_ZSETTS_H
 
+#include <stdint.h>
+#include <string.h>
 #include "redismodule.h"
 #include "rmutil/sds.h"
 #include "dict.h"
+#include "zbtree.h"
+#include "zslab.h"
+#include "zintern.h"
+#ifdef ZSET_USE_ZHASH
+#include "zhash.h"
+#endif
 
+/* Skiplist node. The member is stored inline, as an SDS string placed right
+ * after the level array, and 'ele' points to it. The dict of the sorted set
+ * uses the same embedded string as key. In skiplists with interned members
+ * 'ele' points instead to the shared copy owned by the intern table (see
+ * zintern.h), and nothing follows the level array.
+ *
+ * When built with ZSET_COMPACT_TS the node has no 64 bit timestamp field:
+ * the timestamp is stored as a 32 bit offset from the 'tsbase' of the
+ * skiplist, in the otherwise unused padding of level[0]. Timestamps that
+ * can't be represented even after rebasing are marked with ZSL_TS_ESCAPE
+ * and stored in full in the 8 bytes allocated right before the node. Always
+ * read the timestamp of a node with zslNodeTimestamp().
+ *
+ * In sets with integer members (see zsetParseIntMember()) the value of the
+ * member is stored too, as an uint64_t right before the SDS header of the
+ * embedded member, and is used to hash and order the members without
+ * touching the strings. Integer members are at most ZSET_INT_MEMBER_MAXLEN
+ * bytes long, so their SDS header is always a one byte sdshdr5.
+ *
+ * When built with ZSET_MEMBER_PREFIX the node also caches the order key of
+ * its member (see zslMemberOrder()), that is the first 8 bytes of string
+ * members, so that elements with the same score and timestamp are mostly
+ * ordered without dereferencing 'ele'. */
 typedef struct zskiplistNode {
     sds ele;
     double score;
+#ifndef ZSET_COMPACT_TS
     long long timestamp;
+#endif
     struct zskiplistNode *backward;
+#ifdef ZSET_USE_ZHASH
+    struct zskiplistNode *hnext; /* Next node in the same zhash bucket. */
+#endif
+#ifdef ZSET_MEMBER_PREFIX
+    uint64_t order;     /* zslMemberOrder() of the member. */
+#endif
     struct zskiplistLevel {
         struct zskiplistNode *forward;
-        unsigned int span;
+#ifdef ZSET_COMPACT_TS
+        uint32_t span;      /* Low 32 bits of the span, see zslSpan(). */
+        uint32_t tsoffset;  /* Timestamp offset in level[0], high 32 bits
+                               of the span in the other levels. */
+#else
+        unsigned long span; /* Always access it with zslSpan(). */
+#endif
     } level[];
 } zskiplistNode;
 
+#ifdef ZSET_COMPACT_TS
+#define ZSL_TS_ESCAPE UINT32_MAX
+#endif
+
+#define ZSET_INT_MEMBER_MAXLEN 19
+#define zslNodeIntMember(x) (*(uint64_t*)((x)->ele-1-sizeof(uint64_t)))
+
+#define ZSKIPLIST_MAXLEVEL 32 /* Should be enough for 2^64 elements */
+
+/* Number of positions cached by every skiplist, see zslCursor. */
+#define ZSL_CURSORS 4
+
+/* A node returned by a rank range reply and its 1-based rank. The range
+ * replies remember the last node they return, so that the next page, that
+ * starts right before or after it, is found with a pointer hop instead of
+ * a search by rank. Single element writes adjust the ranks of the cached
+ * positions, and drop the ones of the nodes they unlink. Range deletes and
+ * writes of many elements drop all of them. */
+typedef struct zslCursor {
+    struct zskiplistNode *node; /* NULL if the entry is not used. */
+    unsigned long rank;
+} zslCursor;
+
+/* When 'zbt' is not NULL (the "btree" engine) the nodes only have level 0,
+ * used as a sorted doubly linked list to iterate ranges, and all the
+ * searches are served by the counted B+tree (see zbtree.h). Spans are not
+ * maintained in this case. */
 typedef struct zskiplist {
     struct zskiplistNode *header, *tail;
     unsigned long length;
     int level;
+    /* Last node of every level, the header for empty levels. They are the
+     * nodes to update to append a node without searching. */
+    struct zskiplistNode *rightmost[ZSKIPLIST_MAXLEVEL];
+    zbtree *zbt;
+    zslabPool *pool;    /* Node allocator, NULL to use zmalloc(). */
+    int intmembers;     /* All the members are integers. */
+    int interned;       /* Members are shared via the intern table. */
+    unsigned long churn; /* Nodes created or freed since the skiplist was
+                            built, see zsetCompact(). */
+    zslCursor cursor[ZSL_CURSORS];
+    int nextcursor;     /* Entry of 'cursor' to replace on a miss. */
+    unsigned long long cursor_hits, cursor_misses;
+#ifdef ZSET_COMPACT_TS
+    long long tsbase;   /* Timestamp of the nodes with a tsoffset of 0. */
+    long long tsmin;    /* Smallest and largest timestamps ever stored as */
+    long long tsmax;    /* an offset since the skiplist was last empty. */
+#endif
 } zskiplist;
 
+/* Position of the last node inserted with zslInsertFrom(): for every level
+ * the node after which it was linked (or itself, for its own levels) and
+ * the rank of that node. Inserting keys in ascending order with the same
+ * finger resumes every search from there instead of from the header. A
+ * finger is invalidated setting 'zsl' to NULL, and must be when the
+ * skiplist is modified in any other way. */
+typedef struct zslFinger {
+    zskiplist *zsl;     /* Skiplist of the position, NULL if not set. */
+    struct zskiplistNode *node[ZSKIPLIST_MAXLEVEL];
+    unsigned long rank[ZSKIPLIST_MAXLEVEL];
+} zslFinger;
+
+/* Return the span of level 'i' of the node 'x', the number of nodes its
+ * forward pointer skips. Spans are 64 bit, so that ranks stay exact in
+ * sets with more than 2^32 elements: with ZSET_COMPACT_TS the high half is
+ * kept in the 'tsoffset' slot of the level, that only level 0 uses for the
+ * timestamp, whose span is never larger than 1. */
+static inline unsigned long zslSpan(const zskiplistNode *x, int i) {
+#ifdef ZSET_COMPACT_TS
+    if (i == 0) return x->level[0].span;
+    return ((unsigned long)x->level[i].tsoffset << 32) | x->level[i].span;
+#else
+    return x->level[i].span;
+#endif
+}
+
+static inline void zslSetSpan(zskiplistNode *x, int i, unsigned long span) {
+#ifdef ZSET_COMPACT_TS
+    x->level[i].span = (uint32_t)span;
+    if (i != 0) x->level[i].tsoffset = (uint32_t)(span >> 32);
+#else
+    x->level[i].span = span;
+#endif
+}
+
+/* Return the timestamp of the skiplist node 'x'. */
+static inline long long zslNodeTimestamp(const zskiplist *zsl, const zskiplistNode *x) {
+#ifdef ZSET_COMPACT_TS
+    long long timestamp;
+
+    if (x->level[0].tsoffset != ZSL_TS_ESCAPE)
+        return (long long)((unsigned long long)zsl->tsbase+x->level[0].tsoffset);
+    memcpy(&timestamp,(const char*)x-sizeof(timestamp),sizeof(timestamp));
+    return timestamp;
+#else
+    (void)zsl;
+    return x->timestamp;
+#endif
+}
+
+/* Order key of a member, as returned by zslMemberOrder(). Members that are
+ * not integers, or that belong to a set without integer members, have no
+ * order key, unless built with ZSET_MEMBER_PREFIX. A string member whose
+ * prefix is UINT64_MAX is then just compared as a string. */
+#define ZSL_ORDER_NONE UINT64_MAX
+
+extern const uint64_t zslPow10[ZSET_INT_MEMBER_MAXLEN+1];
+
+/* Compare the member of 'x' with 'ele', with the same result sign as
+ * sdscmp(x->ele,ele). 'order' must be zslMemberOrder() of 'ele': when it is
+ * not ZSL_ORDER_NONE the member of 'x' has an order key of the same kind,
+ * and the members are compared by key, the strings being only touched when
+ * the keys are equal. Without ZSET_MEMBER_PREFIX this only happens in sets
+ * of integer members, and the key of 'x' is computed from its value. */
+static inline int zslCompareMember(const zskiplistNode *x, sds ele, uint64_t order) {
+    if (order == ZSL_ORDER_NONE) return sdscmp(x->ele,ele);
+#ifdef ZSET_MEMBER_PREFIX
+    if (x->order != order) return x->order < order ? -1 : 1;
+    return sdscmp(x->ele,ele);
+#else
+    size_t xlen = sdslen(x->ele), len = sdslen(ele);
+    uint64_t xorder = zslNodeIntMember(x)*zslPow10[ZSET_INT_MEMBER_MAXLEN-xlen];
+
+    if (xorder != order) return xorder < order ? -1 : 1;
+    return xlen < len ? -1 : (xlen > len);
+#endif
+}
+
+/* Ordering key of the score and timestamp of an element. Compared as
+ * unsigned integers the keys of two elements give their order in the set:
+ * score ascending, then timestamp descending. The high half holds the bits
+ * of the score, flipped so that they sort like the doubles, and the low
+ * half the timestamp, flipped so that it sorts in reverse. A search can
+ * then compare score and timestamp with a single comparison, that doesn't
+ * branch on the fields. Where 128 bit integers are not supported the two
+ * halves are compared one after the other. */
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 zslKey;
+#define zslKeyLess(a,b) ((a) < (b))
+#define zslKeyEqual(a,b) ((a) == (b))
+#else
+typedef struct zslKey {
+    uint64_t hi, lo;
+} zslKey;
+#define zslKeyLess(a,b) ((a).hi < (b).hi || ((a).hi == (b).hi && (a).lo < (b).lo))
+#define zslKeyEqual(a,b) ((a).hi == (b).hi && (a).lo == (b).lo)
+#endif
+
+static inline zslKey zslMakeKey(double score, long long timestamp) {
+    uint64_t hi, lo;
+    zslKey key;
+
+    /* Adding 0.0 turns -0.0 into 0.0, as the two scores are equal. Then the
+     * sign bit is set for positive scores, and all the bits are flipped for
+     * negative ones, whose magnitude grows as their value decreases. */
+    score += 0.0;
+    memcpy(&hi,&score,sizeof(hi));
+    hi ^= (uint64_t)((int64_t)hi >> 63) | (1ULL << 63);
+    /* Flipping the sign bit of the timestamp gives an unsigned integer in
+     * the same order, flipping the other bits too reverses the order. */
+    lo = (uint64_t)timestamp ^ ~(1ULL << 63);
+#ifdef __SIZEOF_INT128__
+    key = ((zslKey)hi << 64) | lo;
+#else
+    key.hi = hi;
+    key.lo = lo;
+#endif
+    return key;
+}
+
+/* Ordering key of the skiplist node 'x'. */
+static inline zslKey zslNodeKey(const zskiplist *zsl, const zskiplistNode *x) {
+    return zslMakeKey(x->score,zslNodeTimestamp(zsl,x));
+}
+
+/* Return 1 if the element of 'x' sorts before the element with ordering key
+ * 'key' and member 'ele', whose order key is 'order', or is the same when
+ * 'orequal' is true. The members are only compared when the keys are equal,
+ * that is rare in a search. */
+static inline int zslNodeBefore(const zskiplist *zsl, const zskiplistNode *x, zslKey key, sds ele, uint64_t order, int orequal) {
+    zslKey xkey = zslNodeKey(zsl,x);
+    int cmp;
+
+    if (__builtin_expect(zslKeyEqual(xkey,key),0)) {
+        cmp = zslCompareMember(x,ele,order);
+        return orequal ? cmp <= 0 : cmp < 0;
+    }
+    return zslKeyLess(xkey,key);
+}
+
+/* Sorted set encodings. Small sets are kept in a single packed allocation
+ * (see zpack.h) and are converted to dict+skiplist once they grow past the
+ * configured limits. */
+#define ZSET_ENCODING_SKIPLIST 0
+#define ZSET_ENCODING_PACKED 1
+
+/* Ordered index used by the non packed encoding. */
+#define ZSET_ENGINE_SKIPLIST 0
+#define ZSET_ENGINE_BTREE 1
+
+/* Member -> node index of the dict+skiplist encoding. */
+#ifdef ZSET_USE_ZHASH
+typedef zhash zsetDict;
+#else
+typedef dict zsetDict;
+#endif
+
 typedef struct zset {
-    dict *dict;
+    int encoding;
+    unsigned char *zpk; /* Entries of the packed encoding, otherwise NULL. */
+    zsetDict *dict;     /* dict and zsl are NULL for the packed encoding. */
     zskiplist *zsl;
 } zset;
 
+/* Module configuration, populated from the module load arguments. */
+typedef struct zsetTsConfig {
+    size_t zset_max_packed_entries;
+    size_t zset_max_packed_value;
+    int zset_engine;
+    int zset_node_pool;
+    int zset_int_members;
+    int zset_intern_members;
+    int zset_lazy_free;
+    unsigned long long zset_random_seed;
+} zsetTsConfig;
+
+extern zsetTsConfig ztsConfig;
+
 void freeZsetObject(void *o);
+void zsetFreeNow(zset *zs);
+size_t zsetFreeEffort(RedisModuleString *key, const void *value);
+size_t zsetMemUsage(const void *value);
+int zsetDefrag(RedisModuleDefragCtx *ctx, RedisModuleString *key, void **value);
 
-zset *createZsetObject(void);
+zskiplist *zslCreate(int engine, int pooled, int intmembers, int interned);
+void zslFree(zskiplist *zsl);
 zskiplistNode *zslInsert(zskiplist *zsl, double score, long long timestamp, sds ele);
+int zslDelete(zskiplist *zsl, double score, long long timestamp, sds ele, zskiplistNode **node);
+unsigned long zslGetRank(zskiplist *zsl, double score, long long timestamp, sds ele);
+zskiplistNode *zslGetElementByRank(zskiplist *zsl, unsigned long rank);
+zskiplistNode *zslCursorGetElementByRank(zskiplist *zsl, unsigned long rank, int *slot);
+void zslCursorSet(zskiplist *zsl, int slot, zskiplistNode *x, unsigned long rank);
+void zslCursorsReset(zskiplist *zsl);
+
+zset *createZsetObject(void);
+zset *createZsetPackedObject(void);
+void zsetConvert(zset *zs, int encoding);
+unsigned long zsetLength(const zset *zs);
+zskiplistNode *zsetInsertNew(zset *zs, double score, long long timestamp, sds ele, zslFinger *finger);
+void zslSeedRandom(uint64_t seed);
+void zsetCompact(zset *zs);
+size_t zslEmbeddedHdrSize(size_t len);
+sds zslEmbedEle(char *buf, const char *ele, size_t len);
+uint64_t dictSdsHash(const void *key);
+int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
+int zsetParseIntMember(const char *s, size_t len, uint64_t *value);
+uint64_t zslMemberOrder(int intmembers, sds ele);
+unsigned char *zzlInsert(unsigned char *zp, sds ele, double score, long long timestamp);
 
 int zaddCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 int zincrbyCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
@@ -44,8 +332,12 @@ int zrankCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 int zrevrankCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 int zrangeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 int zrevrangeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+int zrangeafterCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 int zrangebyscoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 int zrevrangebyscoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 int zcountCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+int zstatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+int zcompactCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+int zinternstatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
 
 #endif // __ZSET_TS_ZSETTS_H
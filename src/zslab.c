@@ -0,0 +1,158 @@
+/* Slab pools for skiplist nodes.
+ * See zslab.h for the description of the allocator. */
+
+#include <string.h>
+#include "zslab.h"
+#include "zmalloc.h"
+
+/* The slab header is padded so that objects stay ZSLAB_ALIGN aligned. */
+#define ZSLAB_HDR_SIZE ((sizeof(zslab)+ZSLAB_ALIGN-1)&~(size_t)(ZSLAB_ALIGN-1))
+
+static int zslabClass(size_t size) {
+    return (size+ZSLAB_ALIGN-1)/ZSLAB_ALIGN-1;
+}
+
+/* Allocate a new slab of 'size' bytes, header included, and link it to the
+ * pool. Returns the address of the first object. */
+static char *zslabNewSlab(zslabPool *pool, size_t size) {
+    zslab *slab = zmalloc(size);
+
+    slab->size = size;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+    pool->slab_bytes += size;
+    return (char*)slab+ZSLAB_HDR_SIZE;
+}
+
+/* Put the unused tail of the current shared block in the free lists, as
+ * objects of the largest classes that fit, so that it is not lost when the
+ * block is left. */
+static void zslabRetireBlock(zslabPool *pool) {
+    while (pool->seq_cur != pool->seq_end) {
+        size_t left = pool->seq_end-pool->seq_cur;
+        int class = zslabClass(left > ZSLAB_MAX_OBJ ? ZSLAB_MAX_OBJ : left);
+
+        *(void**)pool->seq_cur = pool->free[class];
+        pool->free[class] = pool->seq_cur;
+        pool->free_objs++;
+        pool->seq_cur += (size_t)(class+1)*ZSLAB_ALIGN;
+    }
+    pool->seq_cur = pool->seq_end = NULL;
+}
+
+/* Return the size of the next shared block in sequential mode, for an
+ * object of 'objsize' bytes. While objects are expected the block is sized
+ * to fit them, estimating their size from the average of the ones already
+ * allocated, plus a small margin. Otherwise blocks are an eighth of the
+ * pool, so that the unused space stays small relative to the objects. */
+static size_t zslabSeqBlockSize(zslabPool *pool, size_t objsize) {
+    size_t size;
+
+    if (pool->seq_expected) {
+        size_t avg = pool->seq_objs ? pool->seq_bytes/pool->seq_objs : objsize;
+
+        if (avg < objsize) avg = objsize;
+        size = pool->seq_expected*avg;
+        size += size/32;
+    } else {
+        size = pool->used_bytes/8;
+        if (size < ZSLAB_SEQ_MIN_BLOCK) size = ZSLAB_SEQ_MIN_BLOCK;
+    }
+    if (size > ZSLAB_SEQ_MAX_BLOCK) size = ZSLAB_SEQ_MAX_BLOCK;
+    if (size < objsize) size = objsize;
+    return (size+ZSLAB_ALIGN-1)&~(size_t)(ZSLAB_ALIGN-1);
+}
+
+/* Create a new empty pool. */
+zslabPool *zslabCreate(void) {
+    zslabPool *pool = zmalloc(sizeof(*pool));
+
+    memset(pool,0,sizeof(*pool));
+    return pool;
+}
+
+/* Release the pool together with all the pooled objects allocated from it.
+ * Objects bigger than ZSLAB_MAX_OBJ must be freed by the caller. */
+void zslabRelease(zslabPool *pool) {
+    zslab *slab = pool->slabs, *next;
+
+    while (slab) {
+        next = slab->next;
+        zfree(slab);
+        slab = next;
+    }
+    zfree(pool);
+}
+
+/* Allocate an object of 'size' bytes from the pool. */
+void *zslabAlloc(zslabPool *pool, size_t size) {
+    int class;
+    size_t objsize;
+    void *ptr;
+
+    if (size > ZSLAB_MAX_OBJ) {
+        pool->large_objs++;
+        return zmalloc(size);
+    }
+    class = zslabClass(size);
+    objsize = (size_t)(class+1)*ZSLAB_ALIGN;
+    pool->used_bytes += objsize;
+
+    if ((ptr = pool->free[class]) != NULL) {
+        pool->free[class] = *(void**)ptr;
+        pool->free_objs--;
+        return ptr;
+    }
+
+    if (pool->sequential) {
+        if ((size_t)(pool->seq_end-pool->seq_cur) < objsize) {
+            size_t blocksize = zslabSeqBlockSize(pool,objsize);
+
+            zslabRetireBlock(pool);
+            pool->seq_cur = zslabNewSlab(pool,ZSLAB_HDR_SIZE+blocksize);
+            pool->seq_end = pool->seq_cur+blocksize;
+        }
+        ptr = pool->seq_cur;
+        pool->seq_cur += objsize;
+        pool->seq_objs++;
+        pool->seq_bytes += objsize;
+        if (pool->seq_expected) pool->seq_expected--;
+        return ptr;
+    }
+
+    if (pool->cur[class] == pool->end[class]) {
+        size_t slabsize = ZSLAB_HDR_SIZE+objsize*ZSLAB_OBJS;
+
+        pool->cur[class] = zslabNewSlab(pool,slabsize);
+        pool->end[class] = pool->cur[class]+objsize*ZSLAB_OBJS;
+    }
+    ptr = pool->cur[class];
+    pool->cur[class] += objsize;
+    return ptr;
+}
+
+/* Return an object of 'size' bytes to the pool. The memory is reused by the
+ * next allocations of the same size class and only given back to the
+ * allocator when the pool is released. */
+void zslabFree(zslabPool *pool, void *ptr, size_t size) {
+    int class = zslabClass(size);
+
+    if (size > ZSLAB_MAX_OBJ) {
+        pool->large_objs--;
+        zfree(ptr);
+        return;
+    }
+    *(void**)ptr = pool->free[class];
+    pool->free[class] = ptr;
+    pool->free_objs++;
+    pool->used_bytes -= (size_t)(class+1)*ZSLAB_ALIGN;
+}
+
+/* Switch the pool to sequential mode (see zslab.h). 'expected' is the
+ * number of objects the caller is about to allocate in sequence if known,
+ * otherwise zero. */
+void zslabSetSequential(zslabPool *pool, unsigned long expected) {
+    pool->sequential = 1;
+    pool->seq_expected = expected;
+}
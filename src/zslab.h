@@ -0,0 +1,65 @@
+/* Slab pools for skiplist nodes.
+ *
+ * Nodes of a sorted set are carved out of slabs owned by the set itself
+ * instead of being allocated one by one. A node size depends on its level
+ * count and on the length of the member embedded in it, so sizes are rounded
+ * to ZSLAB_ALIGN bytes and every size class has its own free list and its
+ * own slabs. Freed nodes go back to the free list of their class, and the
+ * whole pool is released at once when the set is deleted, walking the slabs
+ * instead of the members.
+ *
+ * Objects larger than ZSLAB_MAX_OBJ bytes (very tall nodes or long members)
+ * are not pooled: they are allocated directly and zslabRelease() does not
+ * free them. The pool counts them, so that the owner knows when it has to
+ * walk its objects to free the big ones before releasing the pool.
+ *
+ * A pool can be switched to sequential mode (see zslabSetSequential()): new
+ * objects of all the classes are then carved one after the other out of
+ * shared blocks, so objects allocated in sequence are adjacent in memory
+ * whatever their size. Blocks are sized to fit the objects the owner says
+ * it is about to allocate, otherwise they grow with the pool, always up to
+ * ZSLAB_SEQ_MAX_BLOCK bytes. Freed objects still go to the free list of
+ * their class. */
+
+#ifndef __ZSET_TS_ZSLAB_H
+#define __ZSET_TS_ZSLAB_H
+
+#include <stddef.h>
+
+#define ZSLAB_ALIGN 16
+#define ZSLAB_MAX_OBJ 512
+#define ZSLAB_CLASSES (ZSLAB_MAX_OBJ/ZSLAB_ALIGN)
+#define ZSLAB_OBJS 32 /* Objects per slab. */
+#define ZSLAB_SEQ_MIN_BLOCK (4*1024)    /* Block sizes in sequential mode. */
+#define ZSLAB_SEQ_MAX_BLOCK (256*1024)
+
+typedef struct zslab {
+    struct zslab *next;
+    size_t size;    /* Bytes allocated for this slab, header included. */
+} zslab;
+
+typedef struct zslabPool {
+    void *free[ZSLAB_CLASSES];  /* Free objects, linked via their first word. */
+    char *cur[ZSLAB_CLASSES];   /* Unused tail of the last slab of the class. */
+    char *end[ZSLAB_CLASSES];
+    char *seq_cur;              /* Unused tail of the last shared block */
+    char *seq_end;              /* in sequential mode. */
+    unsigned long seq_expected; /* Objects still expected in sequence. */
+    unsigned long seq_objs;     /* Objects and bytes allocated so far in */
+    size_t seq_bytes;           /* sequential mode. */
+    int sequential;
+    zslab *slabs;               /* All the slabs of the pool. */
+    unsigned long slab_count;
+    size_t slab_bytes;          /* Bytes allocated for slabs. */
+    size_t used_bytes;          /* Bytes of the objects in use. */
+    unsigned long free_objs;    /* Objects waiting in the free lists. */
+    unsigned long large_objs;   /* Objects too big to be pooled. */
+} zslabPool;
+
+zslabPool *zslabCreate(void);
+void zslabRelease(zslabPool *pool);
+void *zslabAlloc(zslabPool *pool, size_t size);
+void zslabFree(zslabPool *pool, void *ptr, size_t size);
+void zslabSetSequential(zslabPool *pool, unsigned long expected);
+
+#endif // __ZSET_TS_ZSLAB_H
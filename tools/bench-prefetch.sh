@@ -0,0 +1,34 @@
+#!/bin/sh
+# Compare bench_prefetch and bench_prefetch_on (see bench_prefetch.c) over
+# several set sizes, and print the best of the runs of every build as a
+# table, in nanoseconds per operation. A size that doesn't fit in memory is
+# reported as failed.
+#
+# Usage: bench-prefetch.sh [sizes...]    (default 1000000 10000000 100000000)
+
+cd "$(dirname "$0")" || exit 1
+SIZES=${*:-1000000 10000000 100000000}
+RUNS=${RUNS:-3}
+
+best() {
+    # Smallest value of the field named $1 over the runs.
+    sed -n "s/.*$1 \([0-9.]*\) ns.*/\1/p" | sort -n | head -1
+}
+
+printf "%-10s %-8s %10s %10s %10s\n" members build insert rank delete
+for n in $SIZES; do
+    for b in bench_prefetch bench_prefetch_on; do
+        case $b in *_on) build=prefetch ;; *) build=default ;; esac
+        out=$(./$b -n "$n" -r "$RUNS" 2>&1)
+        status=$?
+        if [ $status -ne 0 ]; then
+            # 137 is SIGKILL, usually the OOM killer.
+            printf "%-10s %-8s %s\n" "$n" "$build" "failed (exit status $status)"
+            continue
+        fi
+        printf "%-10s %-8s %10s %10s %10s\n" "$n" "$build" \
+            "$(echo "$out" | best zslInsert)" \
+            "$(echo "$out" | best zslGetRank)" \
+            "$(echo "$out" | best zslDelete)"
+    done
+done
@@ -0,0 +1,130 @@
+/* Cost of the range reply cursors (see zslCursor in zsetts.h).
+ *
+ * Single element writes adjust the cached cursors of a skiplist, comparing
+ * the written node with every cursor. In exchange a page of ZRANGE that
+ * starts next to a cursor skips the search by rank. This program measures
+ * both sides on a skiplist of random members:
+ *
+ * - zslInsert() followed by zslDelete() of a new element, with no cursor
+ *   and with the ZSL_CURSORS cursors set, the difference being the cost
+ *   of the adjustment per write (two adjustments, one per call).
+ * - zslGetElementByRank() on random ranks, the search a page served from a
+ *   cursor saves, and zslCursorGetElementByRank() next to a cursor.
+ *
+ * Usage: bench_cursors [-n members] [-o operations] [-r runs]
+ *
+ *   -n  Members of the set (default 1000000).
+ *   -o  Writes and lookups timed in every run (default 1000000).
+ *   -r  Runs (default 3).
+ *
+ * Every run prints the average time of each operation. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zsetts.h"
+#include "toolsapi.h"
+
+#define BENCH_USAGE "Usage: bench_cursors [-n members] [-o operations] [-r runs]"
+#define BENCH_BLOCK 1000 /* Writes timed in a row with the same cursors. */
+
+/* Insert and delete the new elements 'first' to 'first'+'count'-1, one at
+ * a time, and return the time it took in microseconds. */
+static long long benchWrites(zskiplist *zsl, long first, long count, sds *ele) {
+    long long start = toolsUstime();
+    long long timestamp;
+    double score;
+    long i;
+
+    for (i = first; i < first+count; i++) {
+        *ele = toolsElement(*ele,i,&score,&timestamp);
+        zslInsert(zsl,score,timestamp,*ele);
+        zslDelete(zsl,score,timestamp,*ele,NULL);
+    }
+    return toolsUstime()-start;
+}
+
+int main(int argc, char **argv) {
+    long members = 1000000, ops = 1000000, runs = 3;
+    long i, run;
+    long long timestamp;
+    double score;
+    sds ele;
+    long *values[] = {&members,&ops,&runs};
+
+    toolsParseOptions(argc,argv,"nor",values,BENCH_USAGE);
+    if (members <= 1 || ops <= 0 || runs <= 0) toolsUsage(BENCH_USAGE);
+
+    toolsInitModuleApi();
+    ele = sdsempty();
+    printf("%ld members, %d cursors, %ld operations\n",members,ZSL_CURSORS,ops);
+    for (run = 0; run < runs; run++) {
+        zskiplist *zsl = zslCreate(ZSET_ENGINE_SKIPLIST,0,0,0);
+        double nocursors, cursors, search, hop;
+        unsigned long found = 0;
+        long long start;
+        zslCursor saved[ZSL_CURSORS];
+        int slot, j;
+
+        zslSeedRandom(1);
+        for (i = 0; i < members; i++) {
+            ele = toolsElement(ele,i,&score,&timestamp);
+            zslInsert(zsl,score,timestamp,ele);
+        }
+
+        /* Cursors spread over the set, so that the written nodes sort before
+         * some of them and after the others. */
+        for (j = 0; j < ZSL_CURSORS; j++) {
+            unsigned long rank = (unsigned long)members*(j+1)/(ZSL_CURSORS+1);
+            zslCursorSet(zsl,-1,zslGetElementByRank(zsl,rank),rank);
+        }
+        memcpy(saved,zsl->cursor,sizeof(saved));
+
+        /* Blocks of writes without and with the cursors alternate, so that
+         * both see the same state of the caches and of the allocator. */
+        nocursors = cursors = 0;
+        for (i = 0; i < ops; i += BENCH_BLOCK*2) {
+            zslCursorsReset(zsl);
+            nocursors += benchWrites(zsl,members+i,BENCH_BLOCK,&ele);
+            memcpy(zsl->cursor,saved,sizeof(saved));
+            cursors += benchWrites(zsl,members+i+BENCH_BLOCK,BENCH_BLOCK,&ele);
+        }
+        nocursors = nocursors*1000/(i/2);
+        cursors = cursors*1000/(i/2);
+        for (j = 0; j < ZSL_CURSORS; j++) {
+            zslCursor *c = &zsl->cursor[j];
+            if (c->node == NULL ||
+                zslGetRank(zsl,c->node->score,zslNodeTimestamp(zsl,c->node),c->node->ele) != c->rank)
+            {
+                fprintf(stderr,"Cursor %d lost its rank\n",j);
+                return 1;
+            }
+        }
+
+        /* The search by rank of a page that misses the cursors. */
+        start = toolsUstime();
+        for (i = 0; i < ops; i++)
+            found += zslGetElementByRank(zsl,1+toolsMix(i) % members) != NULL;
+        search = (double)(toolsUstime()-start)*1000/ops;
+
+        /* A page that starts right after a cursor. */
+        start = toolsUstime();
+        for (i = 0; i < ops; i++) {
+            zslCursor *c = &zsl->cursor[i % ZSL_CURSORS];
+            found += zslCursorGetElementByRank(zsl,c->rank+1,&slot) != NULL;
+        }
+        hop = (double)(toolsUstime()-start)*1000/ops;
+
+        if (found != (unsigned long)ops*2) {
+            fprintf(stderr,"Only %lu of %ld lookups found a node\n",found,ops*2);
+            return 1;
+        }
+        printf("run %ld: write %.1f ns without cursors, %.1f ns with cursors "
+               "(%+.1f ns), search by rank %.1f ns, cursor hop %.1f ns\n",
+            run+1,nocursors,cursors,cursors-nocursors,search,hop);
+        zslFree(zsl);
+    }
+
+    sdsfree(ele);
+    return 0;
+}
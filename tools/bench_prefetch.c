@@ -0,0 +1,94 @@
+/* Skiplist search microbenchmark for the PREFETCH build option.
+ *
+ * A skiplist of random members is built with zslInsert(), then a sample
+ * of its elements is looked up with zslGetRank() and removed with
+ * zslDelete(). These searches are the ones ZSET_PREFETCH changes. Built
+ * twice by the Makefile, as bench_prefetch and as bench_prefetch_on with
+ * ZSET_PREFETCH. See bench-prefetch.sh to compare the two builds over
+ * several set sizes. A third build, bench_prefetch_libc, draws the levels
+ * of the nodes with random() as Redis does, to compare the insertions
+ * with the xorshift64* generator of the module.
+ *
+ * Usage: bench_prefetch [-n members] [-s sample] [-r runs]
+ *
+ *   -n  Members of the set (default 1000000).
+ *   -s  Elements looked up and removed (default 1000000, at most -n).
+ *   -r  Runs, each one building a new skiplist (default 3).
+ *
+ * The elements are the ones of toolsElement(). Every run prints the
+ * average time of each operation. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zsetts.h"
+#include "toolsapi.h"
+
+#define BENCH_USAGE "Usage: bench_prefetch [-n members] [-s sample] [-r runs]"
+
+int main(int argc, char **argv) {
+    long members = 1000000, sample = 1000000, runs = 3;
+    long i, run;
+    double score;
+    long long timestamp;
+    sds ele;
+    long *values[] = {&members,&sample,&runs};
+
+    toolsParseOptions(argc,argv,"nsr",values,BENCH_USAGE);
+    if (members <= 0 || sample <= 0 || runs <= 0) toolsUsage(BENCH_USAGE);
+    if (sample > members) sample = members;
+
+    toolsInitModuleApi();
+    ele = sdsempty();
+
+#if defined(ZSET_PREFETCH)
+    printf("Build: ZSET_PREFETCH\n");
+#elif defined(ZSET_LIBC_RANDOM)
+    printf("Build: ZSET_LIBC_RANDOM\n");
+#else
+    printf("Build: default\n");
+#endif
+    printf("%ld members, %ld sampled\n",members,sample);
+    for (run = 0; run < runs; run++) {
+        zskiplist *zsl = zslCreate(ZSET_ENGINE_SKIPLIST,0,0,0);
+        unsigned long ranks = 0;
+        long long start, insert, rank, delete;
+
+        zslSeedRandom(1);
+        start = toolsUstime();
+        for (i = 0; i < members; i++) {
+            ele = toolsElement(ele,i,&score,&timestamp);
+            zslInsert(zsl,score,timestamp,ele);
+        }
+        insert = toolsUstime()-start;
+
+        /* The sampled elements are spread over the whole set. */
+        start = toolsUstime();
+        for (i = 0; i < sample; i++) {
+            ele = toolsElement(ele,toolsMix(i) % members,&score,&timestamp);
+            ranks += zslGetRank(zsl,score,timestamp,ele) != 0;
+        }
+        rank = toolsUstime()-start;
+
+        /* The elements are removed in the order they were inserted, which
+         * is random in the order of the set. */
+        start = toolsUstime();
+        for (i = 0; i < sample; i++) {
+            ele = toolsElement(ele,i,&score,&timestamp);
+            zslDelete(zsl,score,timestamp,ele,NULL);
+        }
+        delete = toolsUstime()-start;
+
+        if (ranks != (unsigned long)sample) {
+            fprintf(stderr,"Only %lu of %ld elements found\n",ranks,sample);
+            return 1;
+        }
+        printf("run %ld: zslInsert %.1f ns, zslGetRank %.1f ns, zslDelete %.1f ns\n",
+            run+1,(double)insert*1000/members,(double)rank*1000/sample,
+            (double)delete*1000/sample);
+        zslFree(zsl);
+    }
+
+    sdsfree(ele);
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* zslInsert() microbenchmark on a tie heavy dataset.
+ *
+ * Random members are inserted in a skiplist while only a few distinct
+ * (score, timestamp) pairs are used, so that nearly every comparison of
+ * the searches is a tie broken by the member. Built twice by the Makefile,
+ * as bench_ties and as bench_ties_prefix with ZSET_MEMBER_PREFIX, to
+ * compare the cached member prefix with plain sdscmp() tie-breaks.
+ *
+ * Usage: bench_ties [-n members] [-k pairs] [-l length] [-p prefix] [-r runs]
+ *
+ *   -n  Members to insert (default 1000000).
+ *   -k  Distinct (score, timestamp) pairs (default 4).
+ *   -l  Length of the members in bytes (default 24).
+ *   -p  Leading bytes shared by all the members (default 0). With 8 or more
+ *       the cached prefixes are all equal and every tie needs sdscmp().
+ *   -r  Runs, each one building a new skiplist (default 3).
+ *
+ * Every run prints the average time per insertion. The members and their
+ * order are the same in every run and in both builds. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zsetts.h"
+#include "toolsapi.h"
+
+#define BENCH_USAGE "Usage: bench_ties [-n members] [-k pairs] [-l length] " \
+                    "[-p prefix] [-r runs]"
+
+int main(int argc, char **argv) {
+    long members = 1000000, pairs = 4, len = 24, prefix = 0, runs = 3;
+    long i, j, run;
+    sds *ele;
+    int *pair;
+    char *buf;
+    long *values[] = {&members,&pairs,&len,&prefix,&runs};
+    uint64_t seq = 0;
+
+    toolsParseOptions(argc,argv,"nklpr",values,BENCH_USAGE);
+    if (members <= 0 || pairs <= 0 || len <= 0 || prefix < 0 || prefix >= len ||
+        runs <= 0) toolsUsage(BENCH_USAGE);
+
+    toolsInitModuleApi();
+
+    /* Members are 'prefix' bytes of 'u' followed by random hex digits, so
+     * that they are printable and unique with overwhelming probability. */
+    ele = malloc(sizeof(sds)*members);
+    pair = malloc(sizeof(int)*members);
+    buf = malloc(len);
+    memset(buf,'u',prefix);
+    for (i = 0; i < members; i++) {
+        for (j = prefix; j < len; j++)
+            buf[j] = "0123456789abcdef"[toolsMix(seq++) & 15];
+        ele[i] = sdsnewlen(buf,len);
+        pair[i] = (int)(toolsMix(seq++) % pairs);
+    }
+    free(buf);
+
+#ifdef ZSET_MEMBER_PREFIX
+    printf("Build: ZSET_MEMBER_PREFIX\n");
+#else
+    printf("Build: default\n");
+#endif
+    printf("%ld members of %ld bytes (%ld shared), %ld (score, timestamp) pairs\n",
+        members,len,prefix,pairs);
+    for (run = 0; run < runs; run++) {
+        zskiplist *zsl = zslCreate(ZSET_ENGINE_SKIPLIST,0,0,0);
+        long long start, elapsed;
+
+        zslSeedRandom(1);
+        start = toolsUstime();
+        for (i = 0; i < members; i++)
+            zslInsert(zsl,(double)pair[i],1000000+pair[i],ele[i]);
+        elapsed = toolsUstime()-start;
+        printf("run %ld: zslInsert %.1f ns\n",run+1,(double)elapsed*1000/members);
+        zslFree(zsl);
+    }
+
+    for (i = 0; i < members; i++) sdsfree(ele[i]);
+    free(ele);
+    free(pair);
+    return 0;
+}
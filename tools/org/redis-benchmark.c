@@ -550,6 +550,9 @@ int parseOptions(int argc, const char **argv) {
             if (lastarg) goto invalid;
             config.dbnum = atoi(argv[++i]);
             config.dbnumstr = sdsfromlonglong(config.dbnum);
+        } else if (!strcmp(argv[i],"--seed")) {
+            if (lastarg) goto invalid;
+            srandom(strtoul(argv[++i],NULL,10));
         } else if (!strcmp(argv[i],"--help")) {
             exit_status = 0;
             goto usage;
@@ -593,7 +596,11 @@ usage:
 " -l                 Loop. Run the tests forever\n"
 " -t <tests>         Only run the comma separated list of tests. The test\n"
 "                    names are the same as the ones produced as output.\n"
-" -I                 Idle mode. Just open N idle connections and wait.\n\n"
+" -I                 Idle mode. Just open N idle connections and wait.\n"
+" --seed <seed>      Seed of the __rand_int__ values, so that runs send the\n"
+"                    same commands (in the same order with -c 1). Load the\n"
+"                    module with zset-random-seed as well to compare insert\n"
+"                    throughput on skiplists of the same shape.\n\n"
 "Examples:\n\n"
 " Run the benchmark with the default configuration against 127.0.0.1:6379:\n"
 "   $ redis-benchmark\n\n"
@@ -761,6 +768,15 @@ int main(int argc, const char **argv) {
             free(cmd);
         }
 
+        /* All the elements share the same score and timestamp, so they
+         * are ordered by member only. */
+        if (test_is_selected("zts.zadd_ties")) {
+        	check_zts_rand_keyspace();
+        	len = redisFormatCommand(&cmd,"ZTS.ZADD myzts_ties TS 1 1 __rand_int__:member");
+            benchmark("ZTS.ZADD TIES",cmd,len);
+            free(cmd);
+        }
+
         if (test_is_selected("zts.zrem")) {
         	check_zts_rand_keyspace();
         	len = redisFormatCommand(&cmd,"ZTS.ZREM myzts e:__rand_int__");
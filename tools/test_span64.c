@@ -0,0 +1,365 @@
+/* Test of ranks and RDB lengths above 2^32 elements.
+ *
+ * Sets that large don't fit in the memory of a test machine, so the test
+ * builds a small skiplist and adds gaps to it: the spans of the pointers
+ * that cross a position grow as if billions of elements had been inserted
+ * there, without creating them. The real nodes then have ranks above 2^32
+ * and the spans of the upper levels exceed 32 bits, like in a set of that
+ * size. Built twice by the Makefile, as test_span64 and as
+ * test_span64_compact with ZSET_COMPACT_TS, that keeps the high half of the
+ * spans in a different field.
+ *
+ * The test checks that:
+ *
+ * - zslGetRank() and zslGetElementByRank() agree with the expected rank of
+ *   every real node, and that no node is found at the ranks of a gap.
+ * - zsetTsRDBSave() saves the full 64 bit length of such a set.
+ * - zsetTsRDBLoad() reads that length without truncating it: the gaps add
+ *   up to exactly 2^32 elements, so a length truncated to 32 bits would
+ *   load only the real elements.
+ * - A set saved and loaded back has the same elements in the same order. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "zsetts.h"
+#include "rdb.h"
+#include "toolsapi.h"
+
+#define TEST_ELEMENTS 2000
+#define TEST_GAP (1UL<<31) /* Two gaps add up to 2^32 elements. */
+
+static int failed = 0;
+
+#define test_assert(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr,"%s:%d: assertion failed: %s\n",__FILE__,__LINE__,#cond); \
+        failed++; \
+    } \
+} while(0)
+
+/*-----------------------------------------------------------------------------
+ * In memory RDB stream
+ *----------------------------------------------------------------------------*/
+
+#define TEST_IO_UNSIGNED 0
+#define TEST_IO_SIGNED 1
+#define TEST_IO_DOUBLE 2
+#define TEST_IO_STRING 3
+
+typedef struct testIOItem {
+    int type;
+    uint64_t u;
+    int64_t s;
+    double d;
+    char *buf;
+    size_t len;
+} testIOItem;
+
+/* Values are appended by the Save functions and read back in the same
+ * order by the Load functions. Reading past the last value jumps to 'eof',
+ * where Redis would abort the loading of a truncated RDB file. */
+struct RedisModuleIO {
+    testIOItem *items;
+    size_t count, size, pos;
+    jmp_buf eof;
+};
+
+static testIOItem *testIOAppend(RedisModuleIO *io, int type) {
+    if (io->count == io->size) {
+        io->size = io->size ? io->size*2 : 1024;
+        io->items = realloc(io->items,io->size*sizeof(testIOItem));
+    }
+    memset(&io->items[io->count],0,sizeof(testIOItem));
+    io->items[io->count].type = type;
+    return &io->items[io->count++];
+}
+
+static testIOItem *testIONext(RedisModuleIO *io, int type) {
+    testIOItem *item;
+
+    if (io->pos == io->count) longjmp(io->eof,1);
+    item = &io->items[io->pos++];
+    test_assert(item->type == type);
+    return item;
+}
+
+static void testIOReset(RedisModuleIO *io) {
+    size_t j;
+
+    for (j = 0; j < io->count; j++) free(io->items[j].buf);
+    free(io->items);
+    memset(io,0,sizeof(*io));
+}
+
+static void testSaveUnsigned(RedisModuleIO *io, uint64_t value) {
+    testIOAppend(io,TEST_IO_UNSIGNED)->u = value;
+}
+
+static uint64_t testLoadUnsigned(RedisModuleIO *io) {
+    return testIONext(io,TEST_IO_UNSIGNED)->u;
+}
+
+static void testSaveSigned(RedisModuleIO *io, int64_t value) {
+    testIOAppend(io,TEST_IO_SIGNED)->s = value;
+}
+
+static int64_t testLoadSigned(RedisModuleIO *io) {
+    return testIONext(io,TEST_IO_SIGNED)->s;
+}
+
+static void testSaveDouble(RedisModuleIO *io, double value) {
+    testIOAppend(io,TEST_IO_DOUBLE)->d = value;
+}
+
+static double testLoadDouble(RedisModuleIO *io) {
+    return testIONext(io,TEST_IO_DOUBLE)->d;
+}
+
+static void testSaveStringBuffer(RedisModuleIO *io, const char *str, size_t len) {
+    testIOItem *item = testIOAppend(io,TEST_IO_STRING);
+
+    item->buf = malloc(len);
+    memcpy(item->buf,str,len);
+    item->len = len;
+}
+
+static char *testLoadStringBuffer(RedisModuleIO *io, size_t *lenptr) {
+    testIOItem *item = testIONext(io,TEST_IO_STRING);
+    char *buf = RedisModule_Alloc(item->len);
+
+    memcpy(buf,item->buf,item->len);
+    *lenptr = item->len;
+    return buf;
+}
+
+static void testLogIOError(RedisModuleIO *io, const char *levelstr, const char *fmt, ...) {
+    (void)io;
+    (void)levelstr;
+    fprintf(stderr,"RDB error: %s\n",fmt);
+    failed++;
+}
+
+static void testInitIOApi(void) {
+    RedisModule_SaveUnsigned = testSaveUnsigned;
+    RedisModule_LoadUnsigned = testLoadUnsigned;
+    RedisModule_SaveSigned = testSaveSigned;
+    RedisModule_LoadSigned = testLoadSigned;
+    RedisModule_SaveDouble = testSaveDouble;
+    RedisModule_LoadDouble = testLoadDouble;
+    RedisModule_SaveStringBuffer = testSaveStringBuffer;
+    RedisModule_LoadStringBuffer = testLoadStringBuffer;
+    RedisModule_LogIOError = testLogIOError;
+}
+
+/*-----------------------------------------------------------------------------
+ * Synthetic large sets
+ *----------------------------------------------------------------------------*/
+
+/* Create a set of TEST_ELEMENTS elements in the dict+skiplist encoding.
+ * Scores repeat, so that timestamps and members are compared too. */
+static zset *testCreateSet(void) {
+    zset *zs = createZsetObject();
+    char buf[32];
+    int j;
+
+    for (j = 0; j < TEST_ELEMENTS; j++) {
+        sds ele;
+
+        snprintf(buf,sizeof(buf),"member:%d",j*7919 % TEST_ELEMENTS);
+        ele = sdsnew(buf);
+        zsetInsertNew(zs,(double)(j % 100),1000000+j % 7,ele,NULL);
+        sdsfree(ele);
+    }
+    return zs;
+}
+
+/* Pretend that 'count' elements sort right before the node 't', without
+ * creating them: the pointers that cross that position, one per level,
+ * span 'count' more elements, as if the elements had been inserted there
+ * at level 0. */
+static void testAddGap(zskiplist *zsl, zskiplistNode *t, unsigned long count) {
+    zslKey key = zslNodeKey(zsl,t);
+    uint64_t order = zslMemberOrder(zsl->intmembers,t->ele);
+    zskiplistNode *x = zsl->header;
+    int i;
+
+    for (i = zsl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+               zslNodeBefore(zsl,x->level[i].forward,key,t->ele,order,0))
+            x = x->level[i].forward;
+        zslSetSpan(x,i,zslSpan(x,i)+count);
+    }
+    zsl->length += count;
+}
+
+/* Return the node of rank 'rank' (1 based) walking the level 0. */
+static zskiplistNode *testNodeAt(zskiplist *zsl, int rank) {
+    zskiplistNode *x = zsl->header;
+
+    while (rank--) x = x->level[0].forward;
+    return x;
+}
+
+/* Add two gaps of TEST_GAP elements inside the longest span of the upper
+ * levels that ends on a node, so that the searches of the nodes after it
+ * cross more than 2^32 elements in a single step. Returns the real ranks
+ * of the nodes that follow the gaps. */
+static void testInflate(zskiplist *zsl, int *gap1, int *gap2) {
+    unsigned long rank, bestrank = 0, bestspan = 0;
+    zskiplistNode *x;
+    int i;
+
+    for (i = 1; i < zsl->level; i++) {
+        rank = 0;
+        for (x = zsl->header; x->level[i].forward; x = x->level[i].forward) {
+            if (zslSpan(x,i) > bestspan) {
+                bestrank = rank;
+                bestspan = zslSpan(x,i);
+            }
+            rank += zslSpan(x,i);
+        }
+    }
+    *gap1 = bestrank+1;
+    *gap2 = bestrank+bestspan;
+    testAddGap(zsl,testNodeAt(zsl,*gap1),TEST_GAP);
+    testAddGap(zsl,testNodeAt(zsl,*gap2),TEST_GAP);
+}
+
+/*-----------------------------------------------------------------------------
+ * Tests
+ *----------------------------------------------------------------------------*/
+
+static void testRanks(void) {
+    zset *zs = testCreateSet();
+    zskiplist *zsl = zs->zsl;
+    unsigned long expected = 0, maxspan = 0;
+    long long timestamps[TEST_ELEMENTS];
+    zskiplistNode *x;
+    int gap1, gap2, real = 0, i;
+
+    /* With ZSET_COMPACT_TS the high half of the spans shares its field
+     * with the timestamp of the node, that must not change. */
+    for (x = zsl->header->level[0].forward; x; x = x->level[0].forward)
+        timestamps[real++] = zslNodeTimestamp(zsl,x);
+
+    testInflate(zsl,&gap1,&gap2);
+    test_assert(zsl->length == TEST_ELEMENTS+2*TEST_GAP);
+
+    /* The test is only meaningful if the searches cross a span that needs
+     * more than 32 bits. */
+    test_assert(gap1 < gap2);
+    for (i = 0; i < zsl->level; i++) {
+        for (x = zsl->header; x->level[i].forward; x = x->level[i].forward)
+            if (zslSpan(x,i) > maxspan) maxspan = zslSpan(x,i);
+    }
+    test_assert(maxspan > UINT32_MAX);
+
+    real = 0;
+    for (x = zsl->header->level[0].forward; x; x = x->level[0].forward) {
+        long long timestamp = zslNodeTimestamp(zsl,x);
+
+        real++;
+        expected = real+(real >= gap1 ? TEST_GAP : 0)+(real >= gap2 ? TEST_GAP : 0);
+        test_assert(timestamp == timestamps[real-1]);
+        test_assert(zslGetRank(zsl,x->score,timestamp,x->ele) == expected);
+        test_assert(zslGetElementByRank(zsl,expected) == x);
+    }
+    test_assert(real == TEST_ELEMENTS);
+    test_assert(expected == zsl->length);
+
+    /* The ranks of a gap hold no node. */
+    expected = gap1+TEST_GAP-1;
+    test_assert(zslGetElementByRank(zsl,expected) == NULL);
+    test_assert(zslGetElementByRank(zsl,gap1) == NULL);
+    test_assert(zslGetElementByRank(zsl,zsl->length+1) == NULL);
+
+    freeZsetObject(zs);
+}
+
+static void testRDBLength(void) {
+    zset *zs = testCreateSet();
+    RedisModuleIO io;
+    int gap1, gap2;
+
+    memset(&io,0,sizeof(io));
+    testInflate(zs->zsl,&gap1,&gap2);
+    zsetTsRDBSave(&io,zs);
+    freeZsetObject(zs);
+
+    /* The length, then the real elements only. */
+    test_assert(io.count == 1+3*TEST_ELEMENTS);
+    test_assert(io.items[0].type == TEST_IO_UNSIGNED);
+    test_assert(io.items[0].u == TEST_ELEMENTS+2*TEST_GAP);
+
+    /* Loading such a stream must ask for more elements than the real ones.
+     * The set being loaded is left behind when the stream ends. */
+    if (setjmp(io.eof) == 0) {
+        zsetTsRDBLoad(&io,ZSETTS_ENCODING_VERSION);
+        fprintf(stderr,"zsetTsRDBLoad() stopped at %zu of %zu values, "
+                       "the length was truncated\n",io.pos,io.count);
+        failed++;
+    } else {
+        test_assert(io.pos == io.count);
+    }
+    testIOReset(&io);
+}
+
+static void testRDBRoundTrip(void) {
+    zset *zs = testCreateSet(), *loaded;
+    zskiplistNode *x, *y;
+    RedisModuleIO io;
+
+    memset(&io,0,sizeof(io));
+    zsetTsRDBSave(&io,zs);
+    if (setjmp(io.eof) != 0) {
+        fprintf(stderr,"zsetTsRDBLoad() read past the saved values\n");
+        failed++;
+        testIOReset(&io);
+        freeZsetObject(zs);
+        return;
+    }
+    loaded = zsetTsRDBLoad(&io,ZSETTS_ENCODING_VERSION);
+    test_assert(io.pos == io.count);
+    test_assert(loaded != NULL && zsetLength(loaded) == TEST_ELEMENTS);
+    test_assert(loaded->encoding == ZSET_ENCODING_SKIPLIST);
+
+    x = zs->zsl->header->level[0].forward;
+    y = loaded->zsl->header->level[0].forward;
+    while (x && y) {
+        test_assert(x->score == y->score);
+        test_assert(zslNodeTimestamp(zs->zsl,x) == zslNodeTimestamp(loaded->zsl,y));
+        test_assert(sdslen(x->ele) == sdslen(y->ele) &&
+                    memcmp(x->ele,y->ele,sdslen(x->ele)) == 0);
+        x = x->level[0].forward;
+        y = y->level[0].forward;
+    }
+    test_assert(x == NULL && y == NULL);
+
+    testIOReset(&io);
+    freeZsetObject(zs);
+    freeZsetObject(loaded);
+}
+
+int main(void) {
+    toolsInitModuleApi();
+    testInitIOApi();
+    zslSeedRandom(1);
+
+    testRanks();
+    testRDBLength();
+    testRDBRoundTrip();
+
+#ifdef ZSET_COMPACT_TS
+    printf("test_span64 (ZSET_COMPACT_TS): ");
+#else
+    printf("test_span64: ");
+#endif
+    if (failed) {
+        printf("%d failures\n",failed);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+/* Minimal module runtime for the programs of this directory.
+ * See toolsapi.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <sys/time.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+#include "redismodule.h"
+#include "toolsapi.h"
+
+/* Return the UNIX time in microseconds */
+long long toolsUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+static long long toolsMilliseconds(void) {
+    return toolsUstime()/1000;
+}
+
+static size_t toolsMallocSize(void *ptr) {
+#ifdef __APPLE__
+    return malloc_size(ptr);
+#else
+    return malloc_usable_size(ptr);
+#endif
+}
+
+static void toolsLog(RedisModuleCtx *ctx, const char *level, const char *fmt, ...) {
+    va_list ap;
+
+    (void)ctx;
+    fprintf(stderr,"%s: ",level);
+    va_start(ap,fmt);
+    vfprintf(stderr,fmt,ap);
+    va_end(ap);
+    fprintf(stderr,"\n");
+}
+
+/* dict.c hashes with the siphash() of the Redis server, that the module
+ * finds when it is loaded. Stand-alone programs get this SipHash-1-2, the
+ * variant used by Redis. */
+#define ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64-(b))))
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = ROTL(v1,13); v1 ^= v0; v0 = ROTL(v0,32); \
+        v2 += v3; v3 = ROTL(v3,16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3,21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1,17); v1 ^= v2; v2 = ROTL(v2,32); \
+    } while(0)
+
+/* Read 'len' bytes (at most 8) of 'p' as a little endian integer. */
+static uint64_t toolsLoadLE(const uint8_t *p, size_t len, int nocase) {
+    uint64_t v = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        v |= (uint64_t)(nocase ? tolower(p[i]) : p[i]) << (8*i);
+    return v;
+}
+
+static uint64_t toolsSiphash(const uint8_t *in, size_t inlen, const uint8_t *k, int nocase) {
+    uint64_t k0 = toolsLoadLE(k,8,0), k1 = toolsLoadLE(k+8,8,0);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    size_t left = inlen & 7, i;
+    uint64_t m;
+
+    for (i = 0; i < inlen-left; i += 8) {
+        m = toolsLoadLE(in+i,8,nocase);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+    m = toolsLoadLE(in+i,left,nocase) | ((uint64_t)inlen << 56);
+    v3 ^= m;
+    SIPROUND;
+    v0 ^= m;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    return toolsSiphash(in,inlen,k,0);
+}
+
+uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    return toolsSiphash(in,inlen,k,1);
+}
+
+/* Bijective mix of 'i' (splitmix64 finalizer), used to derive random
+ * looking members, scores and samples from an index. */
+uint64_t toolsMix(uint64_t i) {
+    i += 0x9E3779B97F4A7C15ULL;
+    i = (i ^ (i >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    i = (i ^ (i >> 27)) * 0x94D049BB133111EBULL;
+    return i ^ (i >> 31);
+}
+
+/* Write the member of the element 'i' in 'ele' and return its score and
+ * timestamp by reference. The members are 24 bytes long, the scores take
+ * 1M distinct values and the timestamps 1000, so ties on score and
+ * timestamp are rare. Elements are derived from their index instead of
+ * being stored, so the memory of a benchmark is the one of its set. */
+sds toolsElement(sds ele, uint64_t i, double *score, long long *timestamp) {
+    uint64_t h = toolsMix(i);
+    char buf[32];
+
+    snprintf(buf,sizeof(buf),"m%016llx:%07llu",(unsigned long long)h,
+        (unsigned long long)(i % 10000000));
+    *score = (double)(h % 1000000);
+    *timestamp = 1000000+(long long)(toolsMix(h) % 1000);
+    return sdscpylen(ele,buf,strlen(buf));
+}
+
+/* Print the usage line of a program and exit. */
+void toolsUsage(const char *usage) {
+    fprintf(stderr,"%s\n",usage);
+    exit(1);
+}
+
+/* Parse options of the form "-x number", where 'x' is one of 'letters' and
+ * the number is stored in the entry of 'values' at the same position.
+ * Anything else prints 'usage' and exits. */
+void toolsParseOptions(int argc, char **argv, const char *letters, long **values, const char *usage) {
+    const char *p;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (i+1 == argc || argv[i][0] != '-' || strlen(argv[i]) != 2 ||
+            (p = strchr(letters,argv[i][1])) == NULL) toolsUsage(usage);
+        *values[p-letters] = atol(argv[++i]);
+    }
+}
+
+void toolsInitModuleApi(void) {
+    RedisModule_Alloc = malloc;
+    RedisModule_Calloc = calloc;
+    RedisModule_Realloc = realloc;
+    RedisModule_Free = free;
+    RedisModule_MallocSize = toolsMallocSize;
+    RedisModule_Milliseconds = toolsMilliseconds;
+    RedisModule_Log = toolsLog;
+}
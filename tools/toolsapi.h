@@ -0,0 +1,25 @@
+/* Minimal module runtime for the programs of this directory.
+ *
+ * The benchmarks and tests of tools/ are linked directly with the module
+ * sources, outside of a Redis server. The module API is a table of
+ * function pointers that Redis fills in when the module is loaded, so
+ * these programs call toolsInitModuleApi() first to point the entries the
+ * data structures use (allocation, logging, time) to libc.
+ *
+ * The benchmarks also share their option parsing and the elements they
+ * insert, so that their results are comparable. */
+
+#ifndef __ZSET_TS_TOOLSAPI_H
+#define __ZSET_TS_TOOLSAPI_H
+
+#include <stdint.h>
+#include "rmutil/sds.h"
+
+void toolsInitModuleApi(void);
+long long toolsUstime(void);
+uint64_t toolsMix(uint64_t i);
+sds toolsElement(sds ele, uint64_t i, double *score, long long *timestamp);
+void toolsParseOptions(int argc, char **argv, const char *letters, long **values, const char *usage);
+void toolsUsage(const char *usage);
+
+#endif // __ZSET_TS_TOOLSAPI_H